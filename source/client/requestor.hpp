@@ -1,6 +1,7 @@
 #pragma once
 #include "../common/net.hpp"
 #include "../common/message.hpp"
+#include "../common/timer.hpp"
 #include <future>
 
 /*
@@ -51,6 +52,8 @@ namespace zrcrpc
                 std::promise<BaseMessage::Ptr> _response;
                 RequestCallBack _cb;
                 RpcType _rtype;//这里的rpc请求的类型
+                BaseConnection::Ptr _conn; // 请求是从哪个连接发出去的，连接断开的时候用来找到它上面的请求
+                std::chrono::steady_clock::time_point _start; // 请求登记的时间，用来统计连接上的请求耗时
             };
 
             /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -58,49 +61,70 @@ namespace zrcrpc
             // 当中转中心收到响应以后的处理函数，这个函数主要就是提供给dispatcher模块的
             void onResponse(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg)
             {
-                std::string id = msg->id();
-                RequestDescribe::Ptr rdp = getRequestDescribe(id);
+                // 取出的同时就从表里面删除，超时和响应同时到达的时候只有一方能拿到请求描述
+                RequestDescribe::Ptr rdp = takeRequestDescribe(msg->id());
                 if (rdp == nullptr)
                 {
-                    ELOG("收到的响应报文id不存在");
+                    ELOG("收到的响应报文id不存在，可能已经超时");
                     return;
                 }
-                // 判断对应id的响应类型是异步还是回调函数
-                if (rdp->_rtype == RpcType::REQ_ASYNC)
-                {
-                    // 如果是异步函数，那么直接将响应报文设置进去，这样另一边就可以拿到结果了
-                    rdp->_response.set_value(msg);
-                }
-                else if (rdp->_rtype == RpcType::REQ_CALLBACK)
+                complete(rdp, msg);
+            }
+
+            // 连接断开或者连接超时的时候调用，这个连接上还没有收到响应的请求都以DISCONNECTED结束，不用等到超时
+            void onClose(const BaseConnection::Ptr &conn)
+            {
+                std::vector<RequestDescribe::Ptr> closed;
+                for (auto &sd : _shards)
                 {
-                    // 如果是回调函数，那么就判断回调函数指针是不是空指针，如果不是，那么直接调用回调函数就行
-                    if (rdp->_cb != nullptr)
+                    std::unique_lock<std::mutex> lock(sd._mutex);
+                    for (auto it = sd._request_desc.begin(); it != sd._request_desc.end();)
                     {
-                        rdp->_cb(msg);
+                        if (it->second->_conn == conn)
+                        {
+                            conn->addInflight(-1);
+                            closed.push_back(std::move(it->second));
+                            it = sd._request_desc.erase(it);
+                        }
+                        else
+                            ++it;
                     }
                 }
-                else
+                for (auto &rdp : closed)
                 {
-                    ELOG("收到未知的响应");
+                    fail(rdp, RCode::DISCONNECTED);
                 }
+            }
 
-                // 处理完成以后删除掉requestdescribe信息
-                delRequestDescribe(id);
+            // 由客户端的事件循环定期调用，推动超时时间轮
+            void onTimer()
+            {
+                _wheel.tick();
+            }
+            // 事件循环调用onTimer的时间间隔，单位是秒
+            double timerInterval() const
+            {
+                return _wheel.tickMs() / 1000.0;
             }
 
             // 下面是提供发送端的接口，发送的时候使用，用来设置选择回调函数还是异步控制函数
             // 这里的send的主要逻辑就是，创建requestdescribe描述对象，然后conn发送数据就好
 
+            // timeout_ms大于0的时候表示这个请求的截止时间，到期还没有收到响应，就用一个TIMEOUT的响应结束这个请求
+            // 超时依赖事件循环定期调用onTimer，等于0表示一直等待
+
             // 回调函数
-            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, const RequestCallBack &cb)
+            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, const RequestCallBack &cb, int timeout_ms = 0)
             {
-                RequestDescribe::Ptr rd = createRequestDescibe(req, RpcType::REQ_CALLBACK, cb);
+                RequestDescribe::Ptr rd = createRequestDescibe(conn, req, RpcType::REQ_CALLBACK, cb);
                 if (rd.get() == nullptr)
                 {
                     ELOG("创建请求描述失败");
                     return false;
                 }
+                addTimer(req->id(), timeout_ms);
                 conn->send(req);
+                checkClosed(conn, req->id());
 
                 return true;
             }
@@ -108,76 +132,175 @@ namespace zrcrpc
             // 同步
             // 这里的同步是根据异步实现的，实际上就是直接拿到异步返回数据
             // 这里的异步在上层压根没使用，就是在同步这块使用了，上层都是自己重新实现下异步的
-            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, BaseMessage::Ptr &rsp)
+            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, BaseMessage::Ptr &rsp, int timeout_ms = 0)
             {
                 AsynResponse asyn_resp;
-                bool ret = this->send(conn, req, asyn_resp);
+                bool ret = this->send(conn, req, asyn_resp, timeout_ms);
                 if (ret == false)
                 {
                     return false;
                 }
+                // 同步等待的时候自己也看一下截止时间，即使没有事件循环推动时间轮，调用线程也不会一直阻塞
+                if (timeout_ms > 0 &&
+                    asyn_resp.wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::timeout)
+                {
+                    onTimeout(req->id());
+                }
                 rsp = asyn_resp.get(); // 这里就是返回的resp的请求报文
                 return true;
             }
 
             // 异步
-            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, AsynResponse &asyn_resp)
+            bool send(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, AsynResponse &asyn_resp, int timeout_ms = 0)
             {
 
-                RequestDescribe::Ptr rd = createRequestDescibe(req, RpcType::REQ_ASYNC);
+                RequestDescribe::Ptr rd = createRequestDescibe(conn, req, RpcType::REQ_ASYNC);
                 if (rd.get() == nullptr)
                 {
                     ELOG("创建请求描述失败");
                     return false;
                 }
 
-                conn->send(req);
+                // 先拿到future再发送，响应可能在send返回之前就到达了
                 asyn_resp = rd->_response.get_future();
+                addTimer(req->id(), timeout_ms);
+                conn->send(req);
+                checkClosed(conn, req->id());
                 return true;
             }
 
         private:
+            // 把响应交给发送请求的一方
+            void complete(const RequestDescribe::Ptr &rdp, const BaseMessage::Ptr &msg)
+            {
+                // 超时和断开也算一次样本，这样负载均衡会避开响应慢或者失联的服务提供者
+                auto cost = std::chrono::steady_clock::now() - rdp->_start;
+                rdp->_conn->recordLatency(std::chrono::duration_cast<std::chrono::microseconds>(cost).count());
+                // 判断对应id的响应类型是异步还是回调函数
+                if (rdp->_rtype == RpcType::REQ_ASYNC)
+                {
+                    // 如果是异步函数，那么直接将响应报文设置进去，这样另一边就可以拿到结果了
+                    rdp->_response.set_value(msg);
+                }
+                else if (rdp->_rtype == RpcType::REQ_CALLBACK)
+                {
+                    // 如果是回调函数，那么就判断回调函数指针是不是空指针，如果不是，那么直接调用回调函数就行
+                    if (rdp->_cb != nullptr)
+                    {
+                        rdp->_cb(msg);
+                    }
+                }
+                else
+                {
+                    ELOG("收到未知的响应");
+                }
+            }
+
+            void addTimer(uint64_t id, int timeout_ms)
+            {
+                if (timeout_ms <= 0)
+                    return;
+                _wheel.add(timeout_ms, std::bind(&Reuqestor::onTimeout, this, id));
+            }
+
+            // 请求到期：如果请求还在表里面，就构造一个对应类型的TIMEOUT响应结束这个请求，并且释放请求描述
+            void onTimeout(uint64_t id)
+            {
+                RequestDescribe::Ptr rdp = takeRequestDescribe(id);
+                if (rdp == nullptr)
+                    return; // 响应已经先到了
+                ELOG("请求超时");
+                fail(rdp, RCode::TIMEOUT);
+            }
+
+            // 连接在请求登记之前就已经关闭的话，onClose扫描不到这个请求，发送以后再检查一次，不让请求一直挂着
+            void checkClosed(const BaseConnection::Ptr &conn, uint64_t id)
+            {
+                if (!conn->isClosed())
+                    return;
+                RequestDescribe::Ptr rdp = takeRequestDescribe(id);
+                if (rdp)
+                    fail(rdp, RCode::DISCONNECTED);
+            }
+
+            // 用一个对应类型的错误响应结束请求，上层看到的和收到服务端返回的错误响应是一样的
+            void fail(const RequestDescribe::Ptr &rdp, RCode rcode)
+            {
+                MType rsp_type = MType::RSP_RPC;
+                switch (rdp->_request->messageType())
+                {
+                case MType::REQ_TOPIC:
+                case MType::REQ_TOPIC_BATCH:
+                    rsp_type = MType::RSP_TOPIC;
+                    break;
+                case MType::REQ_SERVICE:
+                    rsp_type = MType::RSP_SERVICE;
+                    break;
+                case MType::REQ_BATCH_RPC:
+                    rsp_type = MType::RSP_BATCH_RPC;
+                    break;
+                default:
+                    break;
+                }
+                auto rsp = std::dynamic_pointer_cast<JsonResponse>(MessageFactory::create(rsp_type));
+                rsp->setId(rdp->_request->id());
+                rsp->setMessageType(rsp_type);
+                rsp->setResponseCode(rcode);
+                complete(rdp, rsp);
+            }
+
             // 下面属于是对于requestdescribe的增、删、查
-            RequestDescribe::Ptr createRequestDescibe(const BaseMessage::Ptr &req, const RpcType &rtpye, const RequestCallBack &cb = RequestCallBack())
+            // 请求表按照id分成多个分片，每个分片一把锁，多个线程同时发请求、收响应的时候大多落在不同的分片上
+            struct Shard
+            {
+                std::mutex _mutex;
+                std::unordered_map<uint64_t, RequestDescribe::Ptr> _request_desc; // 请求ID --- 对应的请求描述
+            };
+            Shard &shard(uint64_t id)
+            {
+                // id的高位是线程编号，低位是线程内的序号，两部分混合一下，同一个线程连续的请求也会分散到不同的分片
+                return _shards[(id ^ (id >> 40)) % ShardNum];
+            }
+
+            RequestDescribe::Ptr createRequestDescibe(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &req, const RpcType &rtpye,
+                                                      const RequestCallBack &cb = RequestCallBack())
             {
-                std::unique_lock<std::mutex> lock(_mutex);
                 RequestDescribe::Ptr rd = std::make_shared<RequestDescribe>();
                 rd->_request = req;
                 rd->_rtype = rtpye;
+                rd->_conn = conn;
+                rd->_start = std::chrono::steady_clock::now();
                 if (rtpye == RpcType::REQ_CALLBACK && cb)
                 {
                     rd->_cb = cb;
                 }
-                _request_desc[req->id()] = rd;
+                // 加锁之前就把请求描述构造好，临界区里面只剩下一次插入
+                conn->addInflight(1);
+                Shard &sd = shard(req->id());
+                std::unique_lock<std::mutex> lock(sd._mutex);
+                sd._request_desc[req->id()] = rd;
                 return rd;
             }
-            RequestDescribe::Ptr getRequestDescribe(const std::string &id)
+            // 查找并且删除，只查找一次，找不到返回空指针
+            RequestDescribe::Ptr takeRequestDescribe(uint64_t id)
             {
-                std::unique_lock<std::mutex> lock(_mutex);
-
-                auto it = _request_desc.find(id);
-                if (it == _request_desc.end())
+                Shard &sd = shard(id);
+                std::unique_lock<std::mutex> lock(sd._mutex);
+                auto it = sd._request_desc.find(id);
+                if (it == sd._request_desc.end())
                 {
-                    ELOG("找不到对应的请求描述");
-                    return std::make_shared<RequestDescribe>();
-                }
-                return it->second;
-            }
-            void delRequestDescribe(const std::string &id)
-            {
-                std::unique_lock<std::mutex> lock(_mutex);
-                auto it = _request_desc.find(id);
-                if (it == _request_desc.end())
-                {
-                    ELOG("找不到对应的请求描述");
-                    return;
+                    return RequestDescribe::Ptr();
                 }
-                _request_desc.erase(it);
+                RequestDescribe::Ptr rdp = std::move(it->second);
+                sd._request_desc.erase(it);
+                rdp->_conn->addInflight(-1);
+                return rdp;
             }
 
         private:
-            std::mutex _mutex;
-            std::unordered_map<std::string, RequestDescribe::Ptr> _request_desc; // 请求ID --- 对应的请求描述
+            static const size_t ShardNum = 32;
+            Shard _shards[ShardNum];
+            TimerWheel _wheel; // 请求超时的时间轮
         };
     }
 }
\ No newline at end of file
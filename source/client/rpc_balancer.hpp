@@ -0,0 +1,242 @@
+#pragma once
+
+#include "../common/message.hpp"
+#include <vector>
+#include <random>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+
+/*
+    该模块实现的是服务发现以后，从可以提供服务的多个主机里面选择一个主机的负载均衡策略
+    1、RoundRobinBalancer：轮询，所有主机平均分配
+    2、WeightedRoundRobinBalancer：加权轮询，按照权重分配，适合机器配置不一样的情况
+    3、P2CBalancer：随机选两个主机，选在途请求少的那个
+    4、EwmaBalancer：随机选两个主机，选 平均耗时*(在途请求+1) 小的那个，慢的主机会自动少分一些请求
+    主机的负载信息由上层通过LoadProbe提供，选择的时候不加锁
+    5、HashRing：带虚拟节点的一致性哈希环，调用方给出路由键的时候，同一个键总是落到同一个主机上，
+       主机上线下线只影响环上相邻的一小段键，服务提供者本地的缓存只需要缓存属于自己的那部分键
+*/
+namespace zrcrpc
+{
+    namespace client
+    {
+        // 一个主机当前的负载
+        struct HostLoad
+        {
+            int _inflight = 0;       // 在途请求数
+            int64_t _latency_us = 0; // 请求耗时的平均值，0表示还没有样本
+        };
+
+        class LoadBalancer
+        {
+        public:
+            using Ptr = std::shared_ptr<LoadBalancer>;
+            using LoadProbe = std::function<HostLoad(const Address &host)>;
+            virtual ~LoadBalancer() = default;
+            // hosts是候选主机的快照，不为空；probe可能为空，为空的时候认为所有主机的负载一样
+            virtual Address select(const std::vector<Address> &hosts, const LoadProbe &probe) = 0;
+
+        protected:
+            static size_t random(size_t n)
+            {
+                static thread_local std::mt19937 generator(std::random_device{}());
+                return std::uniform_int_distribution<size_t>(0, n - 1)(generator);
+            }
+            static HostLoad load(const LoadProbe &probe, const Address &host)
+            {
+                return probe ? probe(host) : HostLoad();
+            }
+        };
+
+        class RoundRobinBalancer : public LoadBalancer
+        {
+        public:
+            virtual Address select(const std::vector<Address> &hosts, const LoadProbe &probe) override
+            {
+                return hosts[_index.fetch_add(1, std::memory_order_relaxed) % hosts.size()];
+            }
+
+        private:
+            std::atomic<size_t> _index{0};
+        };
+
+        class WeightedRoundRobinBalancer : public LoadBalancer
+        {
+            /*
+                每一轮按照权重之和total分配，第n次选择落在(n * Stride) % total这个位置上
+                Stride和total互质，所以一轮里面0~total-1每个位置正好出现一次，每个主机正好分到自己权重那么多次
+                而且相邻两次选择的位置相隔很远，同一个主机的请求不会连续扎堆
+            */
+        public:
+            using WeightMap = std::unordered_map<Address, int, AddressHash>;
+
+            WeightedRoundRobinBalancer() : _weights(std::make_shared<const WeightMap>()) {}
+
+            // 没有设置过权重的主机权重为1，权重小于等于0的主机不会被选中（除非所有主机都是0）
+            void setWeight(const Address &host, int weight)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto weights = std::make_shared<WeightMap>(*std::atomic_load(&_weights));
+                (*weights)[host] = weight;
+                std::atomic_store(&_weights, std::shared_ptr<const WeightMap>(weights));
+            }
+
+            virtual Address select(const std::vector<Address> &hosts, const LoadProbe &probe) override
+            {
+                std::shared_ptr<const WeightMap> weights = std::atomic_load(&_weights);
+                uint64_t total = 0;
+                for (const auto &host : hosts)
+                    total += weight(*weights, host);
+                if (total == 0)
+                    return hosts[_index.fetch_add(1, std::memory_order_relaxed) % hosts.size()];
+                uint64_t n = _index.fetch_add(1, std::memory_order_relaxed) % total;
+                uint64_t pos = (n * (Stride % total)) % total;
+                for (const auto &host : hosts)
+                {
+                    uint64_t w = weight(*weights, host);
+                    if (pos < w)
+                        return host;
+                    pos -= w;
+                }
+                return hosts.back();
+            }
+
+        private:
+            static uint64_t weight(const WeightMap &weights, const Address &host)
+            {
+                auto it = weights.find(host);
+                if (it == weights.end())
+                    return 1;
+                return it->second > 0 ? it->second : 0;
+            }
+
+        private:
+            static const uint64_t Stride = 2654435761ULL; // 一个大素数，和任何实际的权重之和都互质
+            std::mutex _mutex;                             // 只保护权重表的修改
+            std::shared_ptr<const WeightMap> _weights;
+            std::atomic<uint64_t> _index{0};
+        };
+
+        class P2CBalancer : public LoadBalancer
+        {
+        public:
+            virtual Address select(const std::vector<Address> &hosts, const LoadProbe &probe) override
+            {
+                if (hosts.size() == 1)
+                    return hosts[0];
+                size_t a = random(hosts.size());
+                size_t b = random(hosts.size() - 1);
+                if (b >= a)
+                    b++; // 保证选出来的两个主机不是同一个
+                return score(load(probe, hosts[a])) <= score(load(probe, hosts[b])) ? hosts[a] : hosts[b];
+            }
+
+        protected:
+            virtual double score(const HostLoad &load) const
+            {
+                return load._inflight;
+            }
+        };
+
+        class EwmaBalancer : public P2CBalancer
+        {
+        protected:
+            // 耗时越长、排队越多的主机分数越高；还没有样本的主机分数为0，会优先被尝试
+            virtual double score(const HostLoad &load) const override
+            {
+                return (double)load._latency_us * (load._inflight + 1);
+            }
+        };
+
+        class HashRing
+        {
+            /*
+                每个主机在环上放_vnodes个虚拟节点，键落在顺时针方向的第一个虚拟节点对应的主机上
+                环使用写时复制：主机上线下线的时候在当前环的副本上只增加或者删除这一个主机的虚拟节点，再原子地替换
+                查找的时候原子地读取当前的环，不加锁
+            */
+        public:
+            using Ptr = std::shared_ptr<HashRing>;
+            using Ring = std::map<uint64_t, Address>;
+
+            HashRing(int vnodes = DefaultVNodes)
+                : _vnodes(vnodes > 0 ? vnodes : 1), _ring(std::make_shared<const Ring>()) {}
+
+            void addHost(const Address &host)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto ring = std::make_shared<Ring>(*_ring);
+                for (int i = 0; i < _vnodes; i++)
+                {
+                    ring->emplace(hash(vnodeName(host, i)), host); // 哈希冲突的时候保留先加入的主机
+                }
+                std::atomic_store(&_ring, std::shared_ptr<const Ring>(ring));
+            }
+            void delHost(const Address &host)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto ring = std::make_shared<Ring>(*_ring);
+                for (int i = 0; i < _vnodes; i++)
+                {
+                    auto it = ring->find(hash(vnodeName(host, i)));
+                    if (it != ring->end() && it->second == host)
+                        ring->erase(it);
+                }
+                std::atomic_store(&_ring, std::shared_ptr<const Ring>(ring));
+            }
+            bool select(const std::string &key, Address &host) const
+            {
+                std::shared_ptr<const Ring> ring = std::atomic_load(&_ring);
+                if (ring->empty())
+                    return false;
+                auto it = ring->lower_bound(hash(key));
+                if (it == ring->end())
+                    it = ring->begin(); // 绕回环的起点
+                host = it->second;
+                return true;
+            }
+
+            // FNV-1a再做一次混合，让相近的字符串在环上也分散开
+            static uint64_t hash(const std::string &key)
+            {
+                uint64_t h = 14695981039346656037ULL;
+                for (unsigned char c : key)
+                {
+                    h ^= c;
+                    h *= 1099511628211ULL;
+                }
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                h *= 0xc4ceb9fe1a85ec53ULL;
+                h ^= h >> 33;
+                return h;
+            }
+
+        private:
+            static std::string vnodeName(const Address &host, int i)
+            {
+                return host.first + ":" + std::to_string(host.second) + "#" + std::to_string(i);
+            }
+
+        private:
+            static const int DefaultVNodes = 160; // 每个主机的虚拟节点数，越多键分布越均匀，环也越大
+            const int _vnodes;
+            std::mutex _mutex; // 只保护环的修改
+            std::shared_ptr<const Ring> _ring;
+        };
+
+        class BalancerFactory
+        {
+        public:
+            template <typename T, typename... Args>
+            static std::shared_ptr<T> create(Args &&...args)
+            {
+                return std::make_shared<T>(std::forward<Args>(args)...);
+            }
+
+        private:
+        };
+    }
+}
@@ -3,6 +3,7 @@
 #include "../common/message.hpp"
 #include "requestor.hpp"
 #include <future>
+#include <stdexcept>
 /*
         该模块核心：
             只需要向外提供几个rpc调用的接口，内部实现向服务端发送请求，等待获取结果即可
@@ -21,6 +22,12 @@ namespace zrcrpc
             using Ptr = std::shared_ptr<RpcCaller>;
             using JsonAsynResponse = std::future<Json::Value>; // 针对Json::Value类型的result结构而言的future
             using JsonCallBackResponse = std::function<void(const Json::Value &)>;
+            // 带响应码的回调：超时、连接断开、服务端返回错误的时候也会调用，这时候结果是空的Json::Value
+            using JsonCallBackStatus = std::function<void(RCode, const Json::Value &)>;
+            // 批量调用：每一项是 方法名--参数，结果按照同样的顺序返回，每个调用有自己的响应码
+            using BatchCalls = std::vector<std::pair<std::string, Json::Value>>;
+            using BatchResults = std::vector<std::pair<RCode, Json::Value>>;
+            using BatchAsynResponse = std::future<BatchResults>;
 
             RpcCaller(const Reuqestor::Ptr &requestor) : _requestor(requestor) {}
 
@@ -30,12 +37,13 @@ namespace zrcrpc
                 异步call和同步call里面都是调用的是 回调类型的send函数，回调类型的send拿到响应消息后，这里再看是异步模式还是回调模式
                 如果是异步就调用CallBack_Promise去对future<Json::Value>去设置值
                 如果是回调类型就是直接向回调函数里面传入获得的Json::Value对象
+                timeout_ms是这次调用的截止时间，大于0的时候到期没有收到响应就按照RCode::TIMEOUT失败，等于0表示一直等待
             */
 
             // 同步
             // 这里注意const和非const，有时候函数需要的const，但是传入的是非const，所以产生参数不匹配的情况
             bool call(const BaseConnection::Ptr &conn, const std::string &method,
-                      const Json::Value &params, Json::Value &result)
+                      const Json::Value &params, Json::Value &result, int timeout_ms = 0)
             {
                 // DLOG("进入到caller的call");
                 // 1、根据传入的消息组织请求
@@ -49,10 +57,12 @@ namespace zrcrpc
                 req->setMessageType(MType::REQ_RPC);
                 req->setMethod(method);
                 req->setParams(params);
+                if (timeout_ms > 0)
+                    req->setTimeout(timeout_ms); // 把截止时间告诉服务端，过期的请求服务端直接丢弃
                 // 2、发送请求
                 BaseMessage::Ptr resp;
                 // DLOG("准备发送请求");
-                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), resp);
+                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), resp, timeout_ms);
                 // DLOG("已经发送请求");
                 if (!ret)
                 {
@@ -83,7 +93,7 @@ namespace zrcrpc
                 前面的设计思路和同步是一样的，后面发送请求，就是创建promise指针对应里面保存结果Json::Value类型
             */
             bool call(const BaseConnection::Ptr &conn, const std::string &method,
-                      const Json::Value &params, JsonAsynResponse &result)
+                      const Json::Value &params, JsonAsynResponse &result, int timeout_ms = 0)
             {
                 // 1、根据传入的消息组织请求
                 zrcrpc::RpcRequest::Ptr req = MessageFactory::create<RpcRequest>();
@@ -96,6 +106,8 @@ namespace zrcrpc
                 req->setMessageType(MType::REQ_RPC);
                 req->setMethod(method);
                 req->setParams(params);
+                if (timeout_ms > 0)
+                    req->setTimeout(timeout_ms); // 把截止时间告诉服务端，过期的请求服务端直接丢弃
 
                 // 2、发送请求
                 // 这里必须使用指针，不然这个promise是局部变量，函数结束后会被释放掉
@@ -105,7 +117,7 @@ namespace zrcrpc
                 // 当收到response报文的时候，这里的rsp就会被设置，然后onResponse里面会调用这个回调函数CallBack_Promise，这里面的promise会设置Json::Value类型的result;
                 auto resp_promise = std::make_shared<std::promise<Json::Value>>();
                 auto cb = std::bind(&RpcCaller::CallBack_Promise, this, resp_promise, std::placeholders::_1);
-                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), cb);
+                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), cb, timeout_ms);
                 if (!ret)
                 {
                     ELOG("异步Rpc请求失败!");
@@ -117,8 +129,16 @@ namespace zrcrpc
             }
 
             // 回调函数
+            // 调用失败（超时、连接断开、服务端返回错误）的时候resp_cb收到的是空的Json::Value，需要区分原因的时候使用JsonCallBackStatus
             bool call(const BaseConnection::Ptr &conn, const std::string &method,
-                      const Json::Value &params, const JsonCallBackResponse &resp_cb)
+                      const Json::Value &params, const JsonCallBackResponse &resp_cb, int timeout_ms = 0)
+            {
+                auto status_cb = [resp_cb](RCode, const Json::Value &result)
+                { resp_cb(result); };
+                return call(conn, method, params, JsonCallBackStatus(status_cb), timeout_ms);
+            }
+            bool call(const BaseConnection::Ptr &conn, const std::string &method,
+                      const Json::Value &params, const JsonCallBackStatus &resp_cb, int timeout_ms = 0)
             {
                 // 1、根据传入的消息组织请求
                 zrcrpc::RpcRequest::Ptr req = MessageFactory::create<RpcRequest>();
@@ -131,10 +151,12 @@ namespace zrcrpc
                 req->setMessageType(MType::REQ_RPC);
                 req->setMethod(method);
                 req->setParams(params);
+                if (timeout_ms > 0)
+                    req->setTimeout(timeout_ms); // 把截止时间告诉服务端，过期的请求服务端直接丢弃
                 // 2、发送请求
 
                 auto cb = std::bind(&RpcCaller::CallBack_callback, this, resp_cb, std::placeholders::_1);
-                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), cb);
+                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), cb, timeout_ms);
                 if (!ret)
                 {
                     ELOG("回调Rpc请求失败!");
@@ -144,40 +166,126 @@ namespace zrcrpc
                 return true;
             }
 
+            // 批量调用，同步
+            // 整个批量请求失败（发送失败、超时、连接断开）的时候返回false，单个调用的失败只体现在results里面对应的响应码上
+            bool callBatch(const BaseConnection::Ptr &conn, const BatchCalls &calls, BatchResults &results, int timeout_ms = 0)
+            {
+                BatchAsynResponse future;
+                if (callBatch(conn, calls, future, timeout_ms) == false)
+                    return false;
+                try
+                {
+                    results = future.get();
+                }
+                catch (const std::exception &e)
+                {
+                    ELOG("批量Rpc请求失败,%s", e.what());
+                    return false;
+                }
+                return true;
+            }
+
+            // 批量调用，异步
+            bool callBatch(const BaseConnection::Ptr &conn, const BatchCalls &calls, BatchAsynResponse &results, int timeout_ms = 0)
+            {
+                if (calls.empty())
+                {
+                    ELOG("批量Rpc请求里面没有调用");
+                    return false;
+                }
+                zrcrpc::BatchRpcRequest::Ptr req = MessageFactory::create<BatchRpcRequest>();
+                req->setId(UUID::uuid());
+                req->setMessageType(MType::REQ_BATCH_RPC);
+                for (const auto &call : calls)
+                {
+                    req->addCall(call.first, call.second);
+                }
+                if (timeout_ms > 0)
+                    req->setTimeout(timeout_ms);
+
+                auto resp_promise = std::make_shared<std::promise<BatchResults>>();
+                auto cb = std::bind(&RpcCaller::CallBack_Batch, this, resp_promise, calls.size(), std::placeholders::_1);
+                bool ret = _requestor->send(conn, std::dynamic_pointer_cast<BaseMessage>(req), cb, timeout_ms);
+                if (!ret)
+                {
+                    ELOG("批量Rpc请求失败!");
+                    return false;
+                }
+                results = resp_promise->get_future();
+                return true;
+            }
+
         private:
             /*  这里的两个callback，主要就是拿到requesor模块里面的响应消息，然后根据响应消息调用对应的回调模块或者是设置异步参数  */
-            bool CallBack_Promise(std::shared_ptr<std::promise<Json::Value>> resp_promise, const BaseMessage::Ptr &resp)
+            void CallBack_Promise(std::shared_ptr<std::promise<Json::Value>> resp_promise, const BaseMessage::Ptr &resp)
             {
 
                 // 这里的实际调用时机就是在requestor的onResponse里面，requestor里面的promise异步传入msg信息的时候，这里再次根据msg信息异步设置result对象
+                // 出错的时候也要设置promise，否则外部的future.get()拿不到任何结果
                 auto resp_msg = std::dynamic_pointer_cast<RpcResponse>(resp);
                 if (resp_msg == nullptr)
                 {
                     ELOG("向下转换失败");
-                    return false;
+                    resp_promise->set_exception(std::make_exception_ptr(std::runtime_error(ErrReason(RCode::ERROR_MSGTYPE))));
+                    return;
                 }
                 if (resp_msg->responseCode() != RCode::OK)
                 {
-                    ELOG("响应码错误,%s", ErrReason(resp_msg->responseCode()));
-                    return false;
+                    ELOG("响应码错误,%s", ErrReason(resp_msg->responseCode()).c_str());
+                    resp_promise->set_exception(std::make_exception_ptr(std::runtime_error(ErrReason(resp_msg->responseCode()))));
+                    return;
                 }
                 resp_promise->set_value(resp_msg->result()); // 设置异步参数
             }
 
-            bool CallBack_callback(const JsonCallBackResponse &callback_resp, const BaseMessage::Ptr &resp)
+            void CallBack_callback(const JsonCallBackStatus &callback_resp, const BaseMessage::Ptr &resp)
             {
                 auto resp_msg = std::dynamic_pointer_cast<RpcResponse>(resp);
                 if (resp_msg == nullptr)
                 {
                     ELOG("向下转换失败");
-                    return false;
+                    callback_resp(RCode::ERROR_MSGTYPE, Json::Value());
+                    return;
                 }
                 if (resp_msg->responseCode() != RCode::OK)
                 {
-                    ELOG("响应码错误,%s", ErrReason(resp_msg->responseCode()));
-                    return false;
+                    // 超时和连接断开的时候requestor构造的错误响应也走这里，调用方需要知道这次调用已经结束了
+                    ELOG("响应码错误,%s", ErrReason(resp_msg->responseCode()).c_str());
+                    callback_resp(resp_msg->responseCode(), Json::Value());
+                    return;
+                }
+                callback_resp(RCode::OK, resp_msg->result()); // 调用回调函数
+            }
+
+            void CallBack_Batch(std::shared_ptr<std::promise<BatchResults>> resp_promise, size_t count, const BaseMessage::Ptr &resp)
+            {
+                // 超时和连接断开的时候requestor构造的错误响应也是BatchRpcResponse，只是没有result
+                auto resp_msg = std::dynamic_pointer_cast<BatchRpcResponse>(resp);
+                if (resp_msg == nullptr)
+                {
+                    ELOG("向下转换失败");
+                    resp_promise->set_exception(std::make_exception_ptr(std::runtime_error(ErrReason(RCode::ERROR_MSGTYPE))));
+                    return;
+                }
+                if (resp_msg->responseCode() != RCode::OK)
+                {
+                    ELOG("响应码错误,%s", ErrReason(resp_msg->responseCode()).c_str());
+                    resp_promise->set_exception(std::make_exception_ptr(std::runtime_error(ErrReason(resp_msg->responseCode()))));
+                    return;
+                }
+                if (resp_msg->size() != count)
+                {
+                    ELOG("批量响应的结果数量和请求不一致");
+                    resp_promise->set_exception(std::make_exception_ptr(std::runtime_error(ErrReason(RCode::INVALID_MSG))));
+                    return;
+                }
+                BatchResults results;
+                results.reserve(count);
+                for (size_t i = 0; i < count; i++)
+                {
+                    results.emplace_back(resp_msg->responseCode(i), resp_msg->result(i));
                 }
-                callback_resp(resp_msg->result()); // 调用回调函数
+                resp_promise->set_value(std::move(results));
             }
 
         private:
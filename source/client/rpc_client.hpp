@@ -5,6 +5,7 @@
 #include "rpc_registry.hpp"
 #include "../common/dispather.hpp"
 #include "rpc_topic.hpp"
+#include <algorithm>
 
 namespace zrcrpc
 {
@@ -31,13 +32,15 @@ namespace zrcrpc
             {
 
                 // requestor模块提供给dispatcher模块的回调函数
-                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor.get(), std::placeholders::_1, std::placeholders::_2);
+                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor, std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<ServiceResponse>(zrcrpc::MType::RSP_SERVICE, requestor_cb);
 
                 // dispatcher模块提供给client的回调函数
-                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher.get(), std::placeholders::_1, std::placeholders::_2);
+                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher, std::placeholders::_1, std::placeholders::_2);
                 _client = ClientFactory::create(ip, port);
                 _client->setMessageCallback(message_cb);
+                // 连接断开的时候，还在等待响应的请求直接以DISCONNECTED结束
+                _client->setCloseCallback(std::bind(&zrcrpc::client::Reuqestor::onClose, _requestor, std::placeholders::_1));
                 _client->connect();
             }
             bool registryService(const std::string &method, Address &host)
@@ -68,33 +71,48 @@ namespace zrcrpc
                 因为Discovery模块里面包括了一个服务上线和下线的回调函数
             */
             using Ptr = std::shared_ptr<DiscoveryClient>;
-            DiscoveryClient(const std::string ip, int port, const Discoverer::OfflineCallBack &cb)
+            DiscoveryClient(const std::string ip, int port, const Discoverer::OfflineCallBack &cb,
+                            const Discoverer::OnlineCallBack &online_cb = Discoverer::OnlineCallBack())
                 : _requestor(std::make_shared<zrcrpc::client::Reuqestor>()),
-                  _dicoverer(std::make_shared<zrcrpc::client::Discoverer>(_requestor, cb)),
+                  _dicoverer(std::make_shared<zrcrpc::client::Discoverer>(_requestor, cb, online_cb)),
                   _dispatcher(DispatcherFactory::create())
             {
                 // requestor模块提供给dispatcher模块的回调函数
-                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor.get(), std::placeholders::_1, std::placeholders::_2);
+                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor, std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<ServiceResponse>(zrcrpc::MType::RSP_SERVICE, requestor_cb);
 
                 // 这里需要多注册一个discover里面的回调函数给dispatcher模块，就是服务上线和下线函数
-                auto service_cb = std::bind(&zrcrpc::client::Discoverer::onServiceRequest, _dicoverer.get(), std::placeholders::_1, std::placeholders::_2);
+                auto service_cb = std::bind(&zrcrpc::client::Discoverer::onServiceRequest, _dicoverer, std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<ServiceRequest>(zrcrpc::MType::REQ_SERVICE, service_cb);
 
                 // dispatcher模块提供给client的回调函数
-                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher.get(), std::placeholders::_1, std::placeholders::_2);
+                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher, std::placeholders::_1, std::placeholders::_2);
                 _client = ClientFactory::create(ip, port);
                 _client->setMessageCallback(message_cb);
+                // 连接断开的时候，还在等待响应的请求直接以DISCONNECTED结束
+                _client->setCloseCallback(std::bind(&zrcrpc::client::Reuqestor::onClose, _requestor, std::placeholders::_1));
                 _client->connect();
             }
-            bool discoverService(const std::string &method, Address &host) // 发现服务函数直接当作接口
+            bool discoverService(const std::string &method, Address &host, const std::string &key = std::string()) // 发现服务函数直接当作接口
             {
-                return _dicoverer->discoverService(_client->connection(), method, host);
+                return _dicoverer->discoverService(_client->connection(), method, host, key);
             }
             void shutdown()
             {
                 _client->shutdown();
             }
+            void runEvery(double interval, const TimerCallback &task)
+            {
+                _client->runEvery(interval, task);
+            }
+            void setLoadBalancer(const LoadBalancer::Ptr &balancer)
+            {
+                _dicoverer->setLoadBalancer(balancer);
+            }
+            void setLoadProbe(const LoadBalancer::LoadProbe &probe)
+            {
+                _dicoverer->setLoadProbe(probe);
+            }
 
         private:
             /*
@@ -106,6 +124,127 @@ namespace zrcrpc
             BaseClient::Ptr _client;
         };
 
+        class ClientPool
+        {
+            /*
+                同一个服务提供者的一组连接：
+                1、每次选择在途请求最少的连接，大请求不会把其他请求堵在同一条连接后面
+                2、所有连接都比较忙（最空闲的连接在途请求也达到了扩容阈值），并且没有到上限，就新建一个连接
+                3、负载降下来以后由外部定期调用shrink，每次把一个空闲的连接标记为排空，select不再选择它，
+                   到下一次shrink的时候它上面的请求都结束了才真正关闭；select刚选出去的连接不会被立即关掉，
+                   排空期间负载又升上来，需要扩容的时候先把排空的连接拿回来用。最早建立的连接一直保留
+                4、已经断开的连接在选择的时候被移除，连接全部断开以后会重新建立
+                5、池里面的连接把负载变化累加到同一个LoadCounter上，读取整个池的负载不需要加锁
+            */
+        public:
+            using Ptr = std::shared_ptr<ClientPool>;
+            using ClientCreator = std::function<BaseClient::Ptr()>;
+            ClientPool(const ClientCreator &creator, int max_size, int grow_inflight)
+                : _load(std::make_shared<LoadCounter>()), _creator(creator), _max_size(max_size), _grow_inflight(grow_inflight)
+            {
+            }
+            void setLimit(int max_size, int grow_inflight)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _max_size = max_size;
+                _grow_inflight = grow_inflight;
+            }
+            // 放入一个已经创建好的连接
+            void add(const BaseClient::Ptr &client)
+            {
+                client->connection()->setHostLoad(_load);
+                std::unique_lock<std::mutex> lock(_mutex);
+                _clients.push_back(client);
+            }
+            BaseClient::Ptr select()
+            {
+                std::vector<BaseClient::Ptr> closed; // 移除的客户端在锁外面析构，析构的时候要等待它的事件循环
+                std::unique_lock<std::mutex> lock(_mutex);
+                BaseClient::Ptr best;
+                int best_load = 0;
+                for (auto it = _clients.begin(); it != _clients.end();)
+                {
+                    BaseConnection::Ptr conn = (*it)->connection();
+                    if (conn->isClosed())
+                    {
+                        if (*it == _draining)
+                            _draining.reset();
+                        closed.push_back(*it);
+                        it = _clients.erase(it);
+                        continue;
+                    }
+                    if (*it != _draining && (!best || conn->inflight() < best_load))
+                    {
+                        best = *it;
+                        best_load = conn->inflight();
+                    }
+                    ++it;
+                }
+                int active = (int)_clients.size() - (_draining ? 1 : 0);
+                if (!best || (best_load >= _grow_inflight && active < _max_size))
+                {
+                    if (_draining)
+                    {
+                        // 排空的连接还没有关闭，直接恢复使用，不用重新建立连接
+                        best = _draining;
+                        _draining.reset();
+                    }
+                    else
+                    {
+                        best = _creator();
+                        best->connection()->setHostLoad(_load);
+                        _clients.push_back(best);
+                    }
+                }
+                lock.unlock();
+                return best;
+            }
+            void shrink()
+            {
+                BaseClient::Ptr idle;
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_draining)
+                {
+                    // 标记以后select不会再选择它，上面的请求全部结束以后才移除，否则等下一次
+                    if (_draining->connection()->inflight() == 0)
+                    {
+                        idle = _draining;
+                        _draining.reset();
+                        _clients.erase(std::find(_clients.begin(), _clients.end(), idle));
+                    }
+                    lock.unlock();
+                    return;
+                }
+                if (_clients.size() <= 1)
+                    return;
+                int total = 0;
+                for (auto &client : _clients)
+                    total += client->connection()->inflight();
+                // 去掉一个连接以后剩下连接的平均负载还低于扩容阈值的一半才收缩，避免在阈值附近反复扩容收缩
+                if ((int)_clients.size() <= _max_size && total * 2 >= (int)(_clients.size() - 1) * _grow_inflight)
+                    return;
+                for (size_t i = _clients.size() - 1; i > 0; i--)
+                {
+                    if (_clients[i]->connection()->inflight() == 0)
+                    {
+                        _draining = _clients[i];
+                        break;
+                    }
+                }
+            }
+            // 整个连接池的负载：所有连接的在途请求数之和，以及所有连接上的请求一起算出来的平均耗时
+            const LoadCounter::Ptr &loadCounter() const { return _load; }
+
+        private:
+            std::mutex _mutex;
+            const LoadCounter::Ptr _load; // 构造以后不再改变，不需要加锁
+            ClientCreator _creator;
+            int _max_size;      // 连接数量的上限
+            int _grow_inflight; // 最空闲的连接的在途请求数达到这个值就扩容
+            std::vector<BaseClient::Ptr> _clients;
+            BaseClient::Ptr _draining; // 等待关闭的空闲连接，还在_clients里面，但是select不会选择它
+        };
+
         class RpcClient
         {
         public:
@@ -121,65 +260,185 @@ namespace zrcrpc
                     (3)由于维护了_rpc_clients哈希，当服务下线的时候，需要删除掉这个哈希里面的映射关系，所以需要向外提供一个delClient的接口
             */
             using Ptr = std::shared_ptr<RegistryClient>;
-            RpcClient(bool enableDiscovey, const std::string ip, int port)
-                : _enableDiscvory(enableDiscovey),
+            // codec是和服务提供者之间的rpc连接使用的编码方式，和注册中心之间的连接始终使用JSON
+            RpcClient(bool enableDiscovey, const std::string ip, int port, CodecType codec = CodecType::JSON)
+                : _alive(std::make_shared<Liveness>()),
+                  _enableDiscvory(enableDiscovey),
+                  _codec(codec),
+                  _connect_timeout(DefaultConnectTimeout),
+                  _pool_max(DefaultPoolSize),
+                  _pool_grow(DefaultGrowInflight),
                   _requestor(std::make_shared<zrcrpc::client::Reuqestor>()),
                   _caller(std::make_shared<zrcrpc::client::RpcCaller>(_requestor)),
-                  _dispatcher(DispatcherFactory::create())
+                  _dispatcher(DispatcherFactory::create()),
+                  _host_loads(std::make_shared<const LoadMap>())
             {
                 // 这里的rpc_client只能接收到rpc_rsp的响应消息
-                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor.get(),
+                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor,
                                               std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<RpcResponse>(zrcrpc::MType::RSP_RPC, requestor_cb);
+                _dispatcher->registryCallBack<BatchRpcResponse>(zrcrpc::MType::RSP_BATCH_RPC, requestor_cb);
 
                 // 如果开启服务发现功能，那么这里就直接创建服务发现客户端
                 // 这里就会有多个可以提供服务的客户端  add->{ {"127.0.0.1" ：8888},{"127.0.0.1" : 8899}  }
                 if (_enableDiscvory)
                 {
-                    auto del = std::bind(&RpcClient::delClient, this, std::placeholders::_1);
-                    _discovery_client = std::make_shared<DiscoveryClient>(ip, port, del);
+                    // 服务上线/下线的通知在注册中心连接的事件循环线程里面回调，要经过存活检查
+                    auto del = guarded(&RpcClient::delClient);
+                    auto online = guarded(&RpcClient::preConnect);
+                    _discovery_client = std::make_shared<DiscoveryClient>(ip, port, del, online);
+                    // 负载均衡策略需要的负载信息来自每个服务提供者的连接池
+                    _discovery_client->setLoadProbe(std::bind(&RpcClient::hostLoad, this, std::placeholders::_1));
                 }
                 else // 如果不开启服务发现功能，那么这里就是正常的rpc客户端的响应
                 {
                     // 客户端->add(10,20)->服务器 然后这里就是服务器向客户端返回计算结果的响应
-                    auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher.get(),
+                    auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher,
                                                 std::placeholders::_1, std::placeholders::_2);
-                    _rpc_client = ClientFactory::create(ip, port);
+                    _rpc_client = ClientFactory::create(ip, port, _codec);
                     _rpc_client->setMessageCallback(message_cb);
+                    _rpc_client->setCloseCallback(std::bind(&zrcrpc::client::Reuqestor::onClose, _requestor, std::placeholders::_1));
                     _rpc_client->connect();
+                    // 直连模式下也使用连接池，最开始建立的连接一直保留，负载高的时候再增加连接
+                    Address host(ip, port);
+                    _rpc_pool = std::make_shared<ClientPool>(std::bind(&RpcClient::newClient, this, host), _pool_max, _pool_grow);
+                    _rpc_pool->add(_rpc_client);
+                }
+
+                // 请求超时的时间轮挂在一个长期存在的客户端事件循环上推动：开启服务发现的时候是和注册中心的连接，否则就是rpc连接
+                auto timer_cb = std::bind(&zrcrpc::client::Reuqestor::onTimer, _requestor);
+                // 连接池的收缩也挂在同一个事件循环上，事件循环比RpcClient活得久，所以要经过存活检查
+                auto shrink_cb = guarded(&RpcClient::shrinkPools);
+                if (_enableDiscvory)
+                {
+                    _discovery_client->runEvery(_requestor->timerInterval(), timer_cb);
+                    _discovery_client->runEvery(ShrinkInterval, shrink_cb);
                 }
+                else
+                {
+                    _rpc_client->runEvery(_requestor->timerInterval(), timer_cb);
+                    _rpc_client->runEvery(ShrinkInterval, shrink_cb);
+                }
+            }
+            // 定时任务和服务上下线的回调在共用的事件循环线程里面执行，和这里的析构是并发的
+            // 先把存活标记清掉(正在执行的回调会先执行完)，之后这些回调都直接返回，连接池销毁以后不会再被访问
+            ~RpcClient()
+            {
+                std::unique_lock<std::recursive_mutex> lock(_alive->_mutex);
+                _alive->_alive = false;
+            }
+            // 和服务提供者建立连接的超时时间，超时以后在这个连接上排队的请求以RCode::DISCONNECTED失败
+            void setConnectTimeout(int timeout_ms)
+            {
+                _connect_timeout = timeout_ms;
+            }
+
+            // 每个服务提供者最多max_size个连接，最空闲的连接在途请求数达到grow_inflight的时候增加连接
+            void setPoolSize(int max_size, int grow_inflight = DefaultGrowInflight)
+            {
+                max_size = std::max(1, max_size);
+                grow_inflight = std::max(1, grow_inflight);
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pool_max = max_size;
+                _pool_grow = grow_inflight;
+                for (auto &it : _rpc_clients)
+                    it.second->setLimit(max_size, grow_inflight);
+                if (_rpc_pool)
+                    _rpc_pool->setLimit(max_size, grow_inflight);
             }
-            bool call(const std::string &method, const Json::Value &params, Json::Value &result)
+
+            // 开启服务发现的时候，从多个服务提供者里面选择主机的策略，默认轮询，可以在运行过程中替换
+            // 直连模式下只有一个服务提供者，设置了也不起作用
+            void setLoadBalancer(const LoadBalancer::Ptr &balancer)
+            {
+                if (_enableDiscvory)
+                    _discovery_client->setLoadBalancer(balancer);
+            }
+
+            // timeout_ms大于0的时候是这次调用的截止时间，超时按照RCode::TIMEOUT失败
+            // route_key不为空的时候，开启服务发现的情况下按照一致性哈希选择服务提供者，同一个键的请求总是发给同一个主机，
+            // 适合服务提供者本地有缓存的方法；为空的时候按照负载均衡策略选择
+            bool call(const std::string &method, const Json::Value &params, Json::Value &result, int timeout_ms = 0,
+                      const std::string &route_key = std::string())
             {
                 // DLOG("进入到rpc_client的call");
-                auto client = get_Method_Client(method);
+                auto client = get_Method_Client(method, route_key);
                 if (client.get() == nullptr)
                 {
                     ELOG("获取客户端失败");
                     return false;
                 }
                 // DLOG("准备进入下一层caller");
-                return _caller->call(client->connection(), method, params, result);
+                return _caller->call(client->connection(), method, params, result, timeout_ms);
             }
-            bool call(const std::string &method, const Json::Value &params, RpcCaller::JsonAsynResponse &result)
+            bool call(const std::string &method, const Json::Value &params, RpcCaller::JsonAsynResponse &result, int timeout_ms = 0,
+                      const std::string &route_key = std::string())
             {
-                auto client = get_Method_Client(method);
+                auto client = get_Method_Client(method, route_key);
                 if (client.get() == nullptr)
                 {
                     ELOG("获取客户端失败");
                     return false;
                 }
-                return _caller->call(client->connection(), method, params, result);
+                return _caller->call(client->connection(), method, params, result, timeout_ms);
             }
-            bool call(const std::string &method, const Json::Value &params, const RpcCaller::JsonCallBackResponse &resp_cb)
+            bool call(const std::string &method, const Json::Value &params, const RpcCaller::JsonCallBackResponse &resp_cb, int timeout_ms = 0,
+                      const std::string &route_key = std::string())
             {
-                auto client = get_Method_Client(method);
+                auto client = get_Method_Client(method, route_key);
                 if (client.get() == nullptr)
                 {
                     ELOG("获取客户端失败");
                     return false;
                 }
-                return _caller->call(client->connection(), method, params, resp_cb);
+                return _caller->call(client->connection(), method, params, resp_cb, timeout_ms);
+            }
+            // 带响应码的回调，超时和连接断开的时候也会调用
+            bool call(const std::string &method, const Json::Value &params, const RpcCaller::JsonCallBackStatus &resp_cb, int timeout_ms = 0,
+                      const std::string &route_key = std::string())
+            {
+                auto client = get_Method_Client(method, route_key);
+                if (client.get() == nullptr)
+                {
+                    ELOG("获取客户端失败");
+                    return false;
+                }
+                return _caller->call(client->connection(), method, params, resp_cb, timeout_ms);
+            }
+
+            // 批量调用：多个调用放在一个请求里面发给同一个服务提供者，一次往返拿到所有结果
+            // 开启服务发现的时候按照第一个调用的方法选择服务提供者，这个服务提供者没有的方法在结果里面是NOT_FOUND_SERVICE
+            bool callBatch(const RpcCaller::BatchCalls &calls, RpcCaller::BatchResults &results, int timeout_ms = 0,
+                           const std::string &route_key = std::string())
+            {
+                if (calls.empty())
+                {
+                    ELOG("批量调用里面没有调用");
+                    return false;
+                }
+                auto client = get_Method_Client(calls.front().first, route_key);
+                if (client.get() == nullptr)
+                {
+                    ELOG("获取客户端失败");
+                    return false;
+                }
+                return _caller->callBatch(client->connection(), calls, results, timeout_ms);
+            }
+            bool callBatch(const RpcCaller::BatchCalls &calls, RpcCaller::BatchAsynResponse &results, int timeout_ms = 0,
+                           const std::string &route_key = std::string())
+            {
+                if (calls.empty())
+                {
+                    ELOG("批量调用里面没有调用");
+                    return false;
+                }
+                auto client = get_Method_Client(calls.front().first, route_key);
+                if (client.get() == nullptr)
+                {
+                    ELOG("获取客户端失败");
+                    return false;
+                }
+                return _caller->callBatch(client->connection(), calls, results, timeout_ms);
             }
 
         private:
@@ -188,36 +447,62 @@ namespace zrcrpc
             */
             BaseClient::Ptr newClient(const Address &host)
             {
-                // 根据对应的Address创建新的连接，给每个连接都添加对应的Dispatcher的回调函数，然后将新的连接添加到哈希表里面
-                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher.get(),
+                // 根据对应的Address创建新的连接，给每个连接都添加对应的Dispatcher的回调函数
+                // 连接是异步建立的，不会阻塞rpc调用，连接建立之前发送的请求先在连接里面排队
+                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher,
                                             std::placeholders::_1, std::placeholders::_2);
-                auto client = ClientFactory::create(host.first, host.second);
+                auto client = ClientFactory::create(host.first, host.second, _codec);
                 client->setMessageCallback(message_cb);
-                client->connect();
-
-                // 添加到哈希表里面
-                insertClient(host, client);
+                client->setCloseCallback(std::bind(&zrcrpc::client::Reuqestor::onClose, _requestor, std::placeholders::_1));
+                client->connectAsync(_connect_timeout);
                 return client;
             }
-            BaseClient::Ptr getClient(const Address &host)
+            // 查找主机对应的连接池，没有的时候创建一个，连接池里面的连接在第一次选择的时候才建立
+            ClientPool::Ptr getPool(const Address &host)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto it = _rpc_clients.find(host);
+                if (it != _rpc_clients.end())
+                    return it->second;
+                auto pool = std::make_shared<ClientPool>(std::bind(&RpcClient::newClient, this, host), _pool_max, _pool_grow);
+                _rpc_clients[host] = pool;
+                auto loads = std::make_shared<LoadMap>(*std::atomic_load(&_host_loads));
+                (*loads)[host] = pool->loadCounter();
+                std::atomic_store(&_host_loads, std::shared_ptr<const LoadMap>(loads));
+                return pool;
+            }
+            // 提供给负载均衡策略：主机还没有连接池的时候当作空闲主机
+            // 每次选择主机都会调用，只读取负载快照和原子计数，不加锁
+            HostLoad hostLoad(const Address &host)
+            {
+                std::shared_ptr<const LoadMap> loads = std::atomic_load(&_host_loads);
+                auto it = loads->find(host);
+                if (it == loads->end())
+                    return HostLoad();
+                HostLoad load;
+                load._inflight = it->second->_inflight.load(std::memory_order_relaxed);
+                load._latency_us = it->second->_latency_us.load(std::memory_order_relaxed);
+                return load;
+            }
+            // 服务发现得到新的主机的时候在后台提前建立连接
+            void preConnect(const Address &host)
             {
-                // DLOG("进入到getclient");
+                getPool(host)->select();
+            }
+            void shrinkPools()
+            {
+                std::vector<ClientPool::Ptr> pools;
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-                    auto it = _rpc_clients.find(host);
-                    if (it == _rpc_clients.end())
-                    {
-                        // DLOG("在getclient里面创建的");
-                        // 这里必须返回BaseClient::Ptr(),不能在这里直接newclient(host)
-                        // 原因就是这里是加锁的状态，然后newclient里面存在一个insertclient，insertclient里面也会加锁，这里就会产生锁的竞争，导致程序死锁
-
-                        return BaseClient::Ptr();
-                    }
-                    else
-                        return it->second;
+                    for (auto &it : _rpc_clients)
+                        pools.push_back(it.second);
+                    if (_rpc_pool)
+                        pools.push_back(_rpc_pool);
                 }
+                for (auto &pool : pools)
+                    pool->shrink();
             }
-            BaseClient::Ptr get_Method_Client(const std::string &method)
+            BaseClient::Ptr get_Method_Client(const std::string &method, const std::string &route_key)
             {
                 if (_enableDiscvory)
                 {
@@ -225,95 +510,116 @@ namespace zrcrpc
                     // 1. 通过服务发现，获取服务提供者地址信息
                     zrcrpc::Address host;
                     // 这里的host是输出型参数
-                    auto ret = _discovery_client->discoverService(method, host);
+                    auto ret = _discovery_client->discoverService(method, host, route_key);
                     if (ret == false)
                     {
                         ELOG("发现服务失败");
                         return BaseClient::Ptr();
                     }
-                    // 2. 查看服务提供者是否已有实例化客户端，有则直接使用，没有则创建
-                    {
-                        auto client = getClient(host);
-                        if (client.get() == nullptr)
-                        {
-                            // DLOG("进入到getmethodclient 此时client为空 开始创建");
-                            return newClient(host);
-                        }
-                        return client;
-                    }
+                    // 2. 在服务提供者的连接池里面选择在途请求最少的连接，没有连接的时候创建
+                    return getPool(host)->select();
                 }
                 else
                 {
-                    return _rpc_client;
+                    return _rpc_pool->select();
                 }
             }
 
-            void insertClient(const Address &host, const BaseClient::Ptr &client)
-            {
-                std::unique_lock<std::mutex> lock(_mutex);
-                _rpc_clients[host] = client;
-            }
             void delClient(const Address &host)//这个函数是提供给discover_client里面的discoverer的下线函数使用的
             {
+                ClientPool::Ptr old;
                 std::unique_lock<std::mutex> lock(_mutex);
                 auto it = _rpc_clients.find(host);
                 if (it == _rpc_clients.end())
                     return;
-                _rpc_clients.erase(host);
+                old = it->second;
+                _rpc_clients.erase(it);
+                auto loads = std::make_shared<LoadMap>(*std::atomic_load(&_host_loads));
+                loads->erase(host);
+                std::atomic_store(&_host_loads, std::shared_ptr<const LoadMap>(loads));
+                lock.unlock();
             }
-            struct AddressHash
+            void rpcClientShutdown()
             {
-                size_t operator()(const Address &host) const
-                {
-                    // 使用 std::hash 计算各字段的哈希值
-                    size_t h1 = std::hash<std::string>{}(host.first); // IP 地址
-                    size_t h2 = std::hash<int>{}(host.second);        // 端口号
+                _rpc_client->shutdown();
+            }
 
-                    return h1 ^ (h2 << 1); // 简单组合
-                }
+        private:
+            // 事件循环回调到RpcClient的时候检查的存活标记，回调执行的整个过程持有锁
+            // 用递归锁是因为下线回调释放连接的时候，可能通过请求失败的回调重新进入服务发现，再回调到preConnect
+            struct Liveness
+            {
+                std::recursive_mutex _mutex;
+                bool _alive = true;
             };
-            void rpcClientShutdown()
+            template <typename... Args>
+            std::function<void(Args...)> guarded(void (RpcClient::*fn)(Args...))
             {
-                _rpc_client->shutdown();
+                std::shared_ptr<Liveness> alive = _alive;
+                return [this, alive, fn](Args... args)
+                {
+                    std::unique_lock<std::recursive_mutex> lock(alive->_mutex);
+                    if (alive->_alive)
+                        (this->*fn)(args...);
+                };
             }
 
         private:
             std::mutex _mutex; // 主要是保护_rcp_clients哈希
+            std::shared_ptr<Liveness> _alive;
             bool _enableDiscvory;
+            CodecType _codec; // rpc连接使用的编码方式
+            std::atomic<int> _connect_timeout; // 和服务提供者建立连接的超时时间，单位毫秒
+            int _pool_max;                     // 每个服务提供者的连接数上限，受_mutex保护
+            int _pool_grow;                    // 连接池扩容的在途请求阈值，受_mutex保护
             Reuqestor::Ptr _requestor;
             DiscoveryClient::Ptr _discovery_client;
             RpcCaller::Ptr _caller; // 用来进行rpc请求消息的发送
             Dispatcher::Ptr _dispatcher;
             BaseClient::Ptr _rpc_client;
+            ClientPool::Ptr _rpc_pool; // 直连模式下服务提供者的连接池，_rpc_client是里面的第一个连接
 
-            //这里的目的是为了维护一个长连接，将曾经请求的某个主机的地址和连接维护起来
+            //这里的目的是为了维护一个长连接，将曾经请求的某个主机的地址和连接池维护起来
             //只有当这边的服务提供方下线服务的的时候，才开始删除连接
-            std::unordered_map<Address, BaseClient::Ptr, AddressHash> _rpc_clients;
+            std::unordered_map<Address, ClientPool::Ptr, AddressHash> _rpc_clients;
+            // 主机到连接池负载计数的只读快照，在_mutex里面整体替换，hostLoad不加锁读取
+            using LoadMap = std::unordered_map<Address, LoadCounter::Ptr, AddressHash>;
+            std::shared_ptr<const LoadMap> _host_loads;
+            static const int DefaultConnectTimeout = 3000;
+            static const int DefaultPoolSize = 4;      // 每个服务提供者默认最多4个连接
+            static const int DefaultGrowInflight = 16; // 最空闲的连接上有16个在途请求的时候扩容
+            static constexpr double ShrinkInterval = 1.0;
         };
 
         class TopicClient
         {
         public:
             using Ptr = std::shared_ptr<TopicClient>;
-            TopicClient(const std::string &ip, const int &port)
+            TopicClient(const std::string &ip, const int &port, CodecType codec = CodecType::JSON)
                 : _requestor(std::make_shared<zrcrpc::client::Reuqestor>()),
                   _topic_manager(std::make_shared<zrcrpc::client::TopicManager>(_requestor)),
                   _dispatcher(DispatcherFactory::create())
             {
 
                 // requestor模块提供给dispatcher模块的回调函数
-                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor.get(), std::placeholders::_1, std::placeholders::_2);
+                auto requestor_cb = std::bind(&zrcrpc::client::Reuqestor::onResponse, _requestor, std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<TopicResponse>(zrcrpc::MType::RSP_TOPIC, requestor_cb);
 
                 // topic_manager模块提供给dispatcher模块的回调函数
-                auto topic_cb = std::bind(&TopicManager::onPublish, _topic_manager.get(), std::placeholders::_1, std::placeholders::_2);
+                auto topic_cb = std::bind(&TopicManager::onPublish, _topic_manager, std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<TopicRequest>(zrcrpc::MType::REQ_TOPIC, topic_cb);
+                auto batch_cb = std::bind(&TopicManager::onBatchPublish, _topic_manager, std::placeholders::_1, std::placeholders::_2);
+                _dispatcher->registryCallBack<TopicBatchRequest>(zrcrpc::MType::REQ_TOPIC_BATCH, batch_cb);
 
                 // dispatcher模块提供给client的回调函数
-                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher.get(), std::placeholders::_1, std::placeholders::_2);
-                _client = ClientFactory::create(ip, port);
+                auto message_cb = std::bind(&zrcrpc::Dispatcher::onMessage, _dispatcher, std::placeholders::_1, std::placeholders::_2);
+                _client = ClientFactory::create(ip, port, codec);
                 _client->setMessageCallback(message_cb);
+                // 连接断开的时候，还在等待响应的请求直接以DISCONNECTED结束
+                _client->setCloseCallback(std::bind(&zrcrpc::client::Reuqestor::onClose, _requestor, std::placeholders::_1));
                 _client->connect();
+                // 流水线发布的确认超时靠时间轮推动，挂在这个客户端的事件循环上
+                _client->runEvery(_requestor->timerInterval(), std::bind(&zrcrpc::client::Reuqestor::onTimer, _requestor));
             }
             bool create(const std::string &key)
             {
@@ -327,6 +633,15 @@ namespace zrcrpc
             {
                 return _topic_manager->subscribe(_client->connection(), key, cb);
             }
+            // 从from_offset开始订阅，服务端需要开启主题日志
+            bool subscribe(const std::string &key, const TopicManager::SubscribeCallBack &cb, uint64_t from_offset)
+            {
+                return _topic_manager->subscribe(_client->connection(), key, cb, from_offset);
+            }
+            bool nextOffset(const std::string &key, uint64_t &offset)
+            {
+                return _topic_manager->nextOffset(key, offset);
+            }
             bool cancelSubscribe(const std::string &key)
             {
                 return _topic_manager->cancelSubscribe(_client->connection(), key);
@@ -335,6 +650,39 @@ namespace zrcrpc
             {
                 return _topic_manager->publish(_client->connection(), key, topic_msg);
             }
+            // 流水线发布，不等待响应，在途的发布超过窗口的时候阻塞
+            bool publishAsync(const std::string &key, const std::string &topic_msg,
+                              const TopicManager::PublishCallBack &cb = TopicManager::PublishCallBack())
+            {
+                return _topic_manager->publishAsync(_client->connection(), key, topic_msg, cb);
+            }
+            // 一个报文发布多条消息，等待服务端的响应
+            bool publishBatch(const TopicManager::TopicEntries &entries)
+            {
+                return _topic_manager->publishBatch(_client->connection(), entries);
+            }
+            bool publishBatchAsync(const TopicManager::TopicEntries &entries,
+                                   const TopicManager::PublishCallBack &cb = TopicManager::PublishCallBack())
+            {
+                return _topic_manager->publishBatchAsync(_client->connection(), entries, cb);
+            }
+            // 服务端不返回响应的发布
+            bool publishNoAck(const std::string &key, const std::string &topic_msg)
+            {
+                return _topic_manager->publishNoAck(_client->connection(), key, topic_msg);
+            }
+            void setPublishWindow(size_t window)
+            {
+                _topic_manager->setPublishWindow(window);
+            }
+            void setPublishTimeout(int timeout_ms)
+            {
+                _topic_manager->setPublishTimeout(timeout_ms);
+            }
+            bool waitPublished(int timeout_ms = 0)
+            {
+                return _topic_manager->waitPublished(timeout_ms);
+            }
             void shutdown()
             {
                 _client->shutdown();
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "requestor.hpp"
+#include "rpc_balancer.hpp"
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 
 /*
@@ -62,81 +64,117 @@ namespace zrcrpc
         class Hosts
         {
             /*
-                这个模块实现的就是将原本的vector<Address>进行包装，实现rr轮转的功能。
-             
+                这个模块实现的就是将原本的vector<Address>进行包装，由负载均衡策略从里面选择主机。
+                主机列表使用写时复制：上线下线的时候复制一份新的列表再原子地替换，选择主机的时候原子地读取当前列表，不加锁
             */
         public:
             using Ptr = std::shared_ptr<Hosts>;
-            Hosts(const std::vector<Address> &hosts = std::vector<Address>()) : _hosts(hosts) {}
-            Address chooseHost()
+            using HostList = std::vector<Address>;
+            Hosts(const HostList &hosts = HostList()) : _hosts(std::make_shared<const HostList>(hosts))
             {
-                std::unique_lock<std::mutex> lock(_mutex);
-                return _hosts[(_index++ % _hosts.size())];
+                for (const auto &host : hosts)
+                    _ring.addHost(host);
+            }
+
+            std::shared_ptr<const HostList> snapshot() const
+            {
+                return std::atomic_load(&_hosts);
+            }
+            bool chooseHost(const LoadBalancer::Ptr &balancer, const LoadBalancer::LoadProbe &probe, Address &host) const
+            {
+                std::shared_ptr<const HostList> hosts = snapshot();
+                if (hosts->empty())
+                    return false;
+                host = balancer->select(*hosts, probe);
+                return true;
+            }
+            // 按照路由键在一致性哈希环上选择主机，同一个键总是落到同一个主机上
+            bool chooseHost(const std::string &key, Address &host) const
+            {
+                return _ring.select(key, host);
             }
 
             bool addHost(const Address &host)
             {
                 std::unique_lock<std::mutex> lock(_mutex);
-                _hosts.emplace_back(host);
+                auto hosts = std::make_shared<HostList>(*_hosts);
+                if (std::find(hosts->begin(), hosts->end(), host) != hosts->end())
+                    return false; // 重复的上线通知
+                hosts->emplace_back(host);
+                std::atomic_store(&_hosts, std::shared_ptr<const HostList>(hosts));
+                _ring.addHost(host); // 环只增加这一个主机的虚拟节点
                 return true;
             }
             bool delHost(const Address &host)//这里是vector存储的，所以必须遍历找到对应的主机，然后删除
             {
                 std::unique_lock<std::mutex> lock(_mutex);
-                auto it = _hosts.begin();
-                while (it != _hosts.end())
+                auto hosts = std::make_shared<HostList>(*_hosts);
+                auto it = std::find(hosts->begin(), hosts->end(), host);
+                if (it == hosts->end())
                 {
-                    if (*it == host)
-                    {
-                        _hosts.erase(it);
-                        return true;
-                    }
+                    ELOG("删除主机不存在");
+                    return false;
                 }
-                ELOG("删除主机不存在");
-                return false;
+                hosts->erase(it);
+                std::atomic_store(&_hosts, std::shared_ptr<const HostList>(hosts));
+                _ring.delHost(host);
+                return true;
             }
-            bool empty()
+            bool empty() const
             {
-                std::unique_lock<std::mutex> lock(_mutex);
-                return _hosts.empty();
+                return snapshot()->empty();
             }
 
         private:
-            std::mutex _mutex;
-            std::size_t _index;
-            std::vector<Address> _hosts;
+            std::mutex _mutex; // 只保护写操作，多个写操作之间不能互相覆盖
+            std::shared_ptr<const HostList> _hosts;
+            HashRing _ring; // 和_hosts里面的主机保持一致
         };
 
         class Discoverer
         {
             /*
-                1、该模块实现的就是向注册中心进行服务发现，收到注册中心返回回来的可使用的主机集合，这里实现rr轮转的方式实现负载均衡
+                1、该模块实现的就是向注册中心进行服务发现，收到注册中心返回回来的可使用的主机集合，再由负载均衡策略选择主机（默认轮询）
                 2、提供dispather模块一个回调函数，实现服务的上线和下线的功能，实际就是添加或者删除_method_hosts里面的可用主机数量。
                 因为，发现客户端里面维护了<服务，可调用主机>这个哈希，所以服务的上线和下线功能也必须在这里实现比较好
             */
         public:
             using Ptr = std::shared_ptr<Discoverer>;
             using OfflineCallBack = std::function<void(const Address &host)>;
+            using OnlineCallBack = std::function<void(const Address &host)>; // 发现了新的服务主机，上层可以提前建立连接
             /*
                 这个discoverService函数首先判断本主机是否已经存在服务主机集合，如果存在就选择一个可以提供服务的服务端，将该服务端的主机设置到输出型参数当中，然后返回true
                 如果不存在，那么就向注册中心发送消息，拿到注册中心记录的可以提供该服务的主机集合
             */
 
-            Discoverer(Reuqestor::Ptr requestor, OfflineCallBack cb) : _requestor(requestor), _cb(cb) {}
-            bool discoverService(const BaseConnection::Ptr &conn, const std::string &method, Address &host)
+            Discoverer(Reuqestor::Ptr requestor, OfflineCallBack cb, OnlineCallBack online_cb = OnlineCallBack())
+                : _cb(cb), _online_cb(online_cb), _requestor(requestor),
+                  _balancer(BalancerFactory::create<RoundRobinBalancer>()) {}
+
+            // 负载均衡策略和负载信息的来源，可以在运行过程中替换
+            void setLoadBalancer(const LoadBalancer::Ptr &balancer)
+            {
+                std::atomic_store(&_balancer, balancer);
+            }
+            void setLoadProbe(const LoadBalancer::LoadProbe &probe)
+            {
+                std::atomic_store(&_probe, std::make_shared<LoadBalancer::LoadProbe>(probe));
+            }
+            // key不为空的时候按照一致性哈希选择主机，否则按照负载均衡策略选择
+            bool discoverService(const BaseConnection::Ptr &conn, const std::string &method, Address &host,
+                                 const std::string &key = std::string())
             {
                 // 首先判断当前是否存在method对应的服务主机集合，如果存在那么就直接返回
+                // 锁里面只拿到主机集合，选择主机在锁外面进行
+                Hosts::Ptr hosts;
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
                     auto it = _method_hosts.find(method);
                     if (it != _method_hosts.end())
-                    {
-                        if (it->second->empty())
-                            return false;
-                        host = it->second->chooseHost();
-                        return true;
-                    }
+                        hosts = it->second;
                 }
+                if (hosts)
+                    return chooseHost(hosts, key, host);
 
                 // 服务主机集合不存在，这里向服务中心发送服务发现请求
                 // 构造servicerequest消息
@@ -164,19 +202,27 @@ namespace zrcrpc
                     return false;
                 }
 
+                std::vector<Address> addresses = resp_msg->hosts();
+                // 走到这里证明收到注册中心返回的服务响应，创建服务主机集合，添加到_method_hosts里面，然后返回
+                hosts = std::make_shared<Hosts>(addresses);
+                if (hosts->empty()) // 判断注册中心返回的服务主机集合是否为空
+                {
+                    ELOG("没有主机可以提供该服务%s", method.c_str());
+                    return false;
+                }
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-                    // 走到这里证明收到注册中心返回的服务响应，创建服务主机集合，添加到_method_hosts里面，然后返回
-                    auto hosts = std::make_shared<Hosts>(resp_msg->hosts());
-                    if (hosts->empty()) // 判断注册中心返回的服务主机集合是否为空
-                    {
-                        ELOG("没有主机可以提供该服务%s", method.c_str());
-                        return false;
-                    }
                     _method_hosts[method] = hosts;
-                    host = hosts->chooseHost();
-                    return true;
                 }
+                if (chooseHost(hosts, key, host) == false)
+                    return false;
+                // 其余的主机在后台提前建立连接，之后轮询到它们的时候不用再等待连接建立
+                for (const auto &addr : addresses)
+                {
+                    if (_online_cb && addr != host)
+                        _online_cb(addr);
+                }
+                return true;
             }
 
             // 服务上线/下线通知  注册中心向发现者发送服务上线/下线的消息
@@ -214,7 +260,6 @@ namespace zrcrpc
                         else
                         {
                             it->second->delHost(msg->host());//这里是将该方法的对应主机删除
-                            _cb(msg->host());
                         }
                     }
                     else
@@ -223,12 +268,31 @@ namespace zrcrpc
                         return;
                     }
                 }
+                // 回调都在锁外面调用：新上线的主机在后台建立连接，下线的主机删除对应的长连接
+                if (otype == ServiceOptype::SERVICE_ONLINE && _online_cb)
+                    _online_cb(msg->host());
+                else if (otype == ServiceOptype::SERVICE_OFFLINE && _cb)
+                    _cb(msg->host());
+            }
+
+        private:
+            // 有路由键的时候走一致性哈希环，否则按照当前的负载均衡策略从主机集合的快照里面选择一个主机，整个过程不加锁
+            bool chooseHost(const Hosts::Ptr &hosts, const std::string &key, Address &host)
+            {
+                if (!key.empty())
+                    return hosts->chooseHost(key, host);
+                LoadBalancer::Ptr balancer = std::atomic_load(&_balancer);
+                std::shared_ptr<LoadBalancer::LoadProbe> probe = std::atomic_load(&_probe);
+                return hosts->chooseHost(balancer, probe ? *probe : LoadBalancer::LoadProbe(), host);
             }
 
         private:
             std::mutex _mutex;
             OfflineCallBack _cb;
+            OnlineCallBack _online_cb;
             Reuqestor::Ptr _requestor;
+            LoadBalancer::Ptr _balancer;
+            std::shared_ptr<LoadBalancer::LoadProbe> _probe;
             std::unordered_map<std::string, Hosts::Ptr> _method_hosts;
         };
     }
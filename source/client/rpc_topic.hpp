@@ -1,9 +1,14 @@
 #pragma once
 
 #include "requestor.hpp"
+#include "../common/topic_trie.hpp"
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <vector>
+#include <cstdint>
 #include <unordered_map>
+#include <algorithm>
 
 /*
     主题客户端主要分为两种主题发布客户端和主题订阅客户端，里面的功能实现的都是向中转服务端发送操作请求
@@ -16,6 +21,16 @@
 
 
     这里的TopicManager就是实现上述的主题功能，客户端再根据自己的需求来调用
+    订阅的时候可以使用通配符（md.eq.*、md.#），收到推送的时候本地也按照同样的规则匹配，
+    直接订阅了这个主题的回调和所有能匹配的通配订阅的回调都会被调用
+    服务端开启主题日志以后推送的消息带有offset，这里记录每个主题下一条要收的offset，
+    断线重连以后可以从这个offset重新订阅，补发的消息和实时推送重叠的部分按照offset丢掉
+    发布除了同步等待响应的publish，还有两种方式：
+    1、publishAsync：流水线发布，发出去就返回，响应在IO线程里面回来，在途的发布数量超过窗口的时候阻塞发布者
+       同一个事件循环里面的多个响应会被服务端合并成一次写，确认是成批回来的
+    2、publishNoAck：服务端不返回响应，适合丢几条也无所谓的遥测类主题
+    3、publishBatch：多条消息（可以是不同的主题）放在一个报文里面发布，只有一个响应
+    服务端开启合并推送以后，推送过来的是批量报文，里面的每条消息和单条推送一样处理
 */
 namespace zrcrpc
 {
@@ -26,7 +41,10 @@ namespace zrcrpc
         public:
             using Ptr = std::shared_ptr<TopicManager>;
             using SubscribeCallBack = std::function<void(const std::string  &, const std::string &)>;
-            TopicManager(const Reuqestor::Ptr &requestor) : _requestor(requestor) {}
+            using PublishCallBack = std::function<void(RCode)>; // 流水线发布收到确认的时候调用
+            using TopicEntries = std::vector<std::pair<std::string, std::string>>; // 批量发布的消息：主题--消息
+            TopicManager(const Reuqestor::Ptr &requestor)
+                : _requestor(requestor), _publish_timeout(DefaultPublishTimeout), _window(DefaultWindow), _inflight(0) {}
 
             bool create(const BaseConnection::Ptr &conn, const std::string &key)
             {
@@ -39,6 +57,7 @@ namespace zrcrpc
             bool subscribe(const BaseConnection::Ptr &conn, const std::string &key, const SubscribeCallBack &cb)
             {
                 addSubscribeCallBack(key, cb);
+                clearNextOffset(key);
                 bool ret = createRequestMessage(conn, key, TopicOptype::TOPIC_SUBSCRIBE);
                 if (ret == false) // 如果创建失败就移出对应的回调函数
                 {
@@ -47,6 +66,29 @@ namespace zrcrpc
                 }
                 return true;
             }
+            // 从from_offset开始订阅，服务端会先补发日志里面from_offset之后的消息
+            bool subscribe(const BaseConnection::Ptr &conn, const std::string &key, const SubscribeCallBack &cb, uint64_t from_offset)
+            {
+                addSubscribeCallBack(key, cb);
+                setNextOffset(key, from_offset);
+                bool ret = createRequestMessage(conn, key, TopicOptype::TOPIC_SUBSCRIBE, std::string(), from_offset);
+                if (ret == false)
+                {
+                    removeSubscribeCallBack(key);
+                    return false;
+                }
+                return true;
+            }
+            // 主题下一条要收的offset，还没有收到过带offset的消息的时候返回false
+            bool nextOffset(const std::string &key, uint64_t &offset)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto it = _offsets.find(key);
+                if (it == _offsets.end())
+                    return false;
+                offset = it->second;
+                return true;
+            }
             bool cancelSubscribe(const BaseConnection::Ptr &conn, const std::string &key)
             {
                 removeSubscribeCallBack(key);
@@ -56,6 +98,82 @@ namespace zrcrpc
             {
                 return createRequestMessage(conn, key, TopicOptype::TOPIC_PUBLISH,topic_msg);
             }
+            // 批量发布，等待服务端的响应，所有消息都发布成功才返回true
+            bool publishBatch(const BaseConnection::Ptr &conn, const TopicEntries &entries)
+            {
+                if (entries.empty())
+                    return true;
+                BaseMessage::Ptr base_msg;
+                if (_requestor->send(conn, makeBatchRequest(entries), base_msg) == false)
+                {
+                    ELOG("主题消息批量发布失败");
+                    return false;
+                }
+                auto resp_msg = std::dynamic_pointer_cast<TopicResponse>(base_msg);
+                if (resp_msg.get() == nullptr || resp_msg->responseCode() != RCode::OK)
+                {
+                    ELOG("主题消息批量发布失败,%s", resp_msg ? ErrReason(resp_msg->responseCode()).c_str() : "响应类型错误");
+                    return false;
+                }
+                return true;
+            }
+            // 流水线批量发布，整个批量占窗口里面的一个位置
+            bool publishBatchAsync(const BaseConnection::Ptr &conn, const TopicEntries &entries,
+                                   const PublishCallBack &cb = PublishCallBack())
+            {
+                if (entries.empty())
+                    return true;
+                return sendAsync(conn, makeBatchRequest(entries), cb);
+            }
+            // 流水线发布：不等待响应，在途的发布达到窗口大小的时候阻塞，直到有确认回来
+            // cb在IO线程里面调用，cb和订阅回调里面不能调用publishAsync，窗口满的时候会卡住IO线程
+            bool publishAsync(const BaseConnection::Ptr &conn, const std::string &key, const std::string &topic_msg,
+                              const PublishCallBack &cb = PublishCallBack())
+            {
+                auto msg = makeRequest(key, TopicOptype::TOPIC_PUBLISH);
+                msg->setMessage(topic_msg);
+                return sendAsync(conn, msg, cb);
+            }
+            // 不需要确认的发布，服务端不返回响应，连接断开的时候消息直接丢掉
+            bool publishNoAck(const BaseConnection::Ptr &conn, const std::string &key, const std::string &topic_msg)
+            {
+                if (!conn->isConnected())
+                {
+                    ELOG("连接已经断开，主题%s的消息没有发出去", key.c_str());
+                    return false;
+                }
+                auto msg = makeRequest(key, TopicOptype::TOPIC_PUBLISH);
+                msg->setMessage(topic_msg);
+                msg->setNoAck(true);
+                conn->send(msg);
+                return true;
+            }
+            // 设置流水线发布的窗口大小，也就是最多有多少条发布还没有收到确认
+            void setPublishWindow(size_t window)
+            {
+                std::unique_lock<std::mutex> lock(_window_mutex);
+                _window = window > 0 ? window : 1;
+                _window_cond.notify_all();
+            }
+            // 流水线发布等待确认的超时时间，超时的发布以RCode::TIMEOUT结束并且归还窗口，确认丢了也不会一直占着窗口
+            // 0表示一直等待，超时需要客户端的事件循环定期调用requestor的onTimer
+            void setPublishTimeout(int timeout_ms)
+            {
+                _publish_timeout = timeout_ms > 0 ? timeout_ms : 0;
+            }
+            // 等待所有流水线发布都收到确认，timeout_ms大于0的时候最多等这么久，超时返回false
+            bool waitPublished(int timeout_ms = 0)
+            {
+                std::unique_lock<std::mutex> lock(_window_mutex);
+                auto done = [this]()
+                { return _inflight == 0; };
+                if (timeout_ms <= 0)
+                {
+                    _window_cond.wait(lock, done);
+                    return true;
+                }
+                return _window_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+            }
             void onPublish(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
                 // 首先判断消息类型是不是发布类型
@@ -65,30 +183,47 @@ namespace zrcrpc
                     ELOG("收到错误的消息类型")
                     return;
                 }
-                // 判断是否存在的对应的回调函数
-                auto cb = getSubscribeCallBack(topic_name);
-                if (!cb)
+                deliver(topic_name, msg->message(), msg->hasOffset() ? msg->offset() : NoOffset);
+                return;
+            }
+            // 服务端合并推送过来的批量报文，按顺序一条一条处理
+            void onBatchPublish(const BaseConnection::Ptr &conn, const TopicBatchRequest::Ptr &msg)
+            {
+                for (size_t i = 0; i < msg->size(); i++)
                 {
-                    ELOG("收到主题%s,不存在对应的回调函数", msg->key().c_str());
-                    return;
+                    deliver(msg->key(i), msg->message(i), msg->hasOffset(i) ? msg->offset(i) : NoOffset);
                 }
-                cb( msg->key(),msg->message());
-                return;
             }
 
         private:
+            void deliver(const std::string &topic_name, const std::string &topic_msg, uint64_t offset)
+            {
+                // 补发和实时推送重叠的消息已经处理过了
+                if (offset != NoOffset && !advanceOffset(topic_name, offset))
+                    return;
+                // 判断是否存在的对应的回调函数
+                std::vector<SubscribeCallBack> cbs = getSubscribeCallBacks(topic_name);
+                if (cbs.empty())
+                {
+                    ELOG("收到主题%s,不存在对应的回调函数", topic_name.c_str());
+                    return;
+                }
+                for (auto &cb : cbs)
+                {
+                    cb(topic_name, topic_msg);
+                }
+            }
             bool createRequestMessage(const BaseConnection::Ptr &conn, const std::string &key,
-                                      const TopicOptype &otype, const std::string &topic_msg = std::string())
+                                      const TopicOptype &otype, const std::string &topic_msg = std::string(),
+                                      uint64_t offset = NoOffset)
             {
                 DLOG("进入到createRequestMessage");
 
-                auto msg = MessageFactory::create<TopicRequest>();
-                msg->setId(UUID::uuid());
-                msg->setKey(key);
-                msg->setMessageType(MType::REQ_TOPIC);
-                msg->setOperationType(otype);
+                auto msg = makeRequest(key, otype);
                 if (otype == TopicOptype::TOPIC_PUBLISH)
                     msg->setMessage(topic_msg);
+                if (offset != NoOffset)
+                    msg->setOffset(offset);
 
                 BaseMessage::Ptr base_msg = MessageFactory::create<TopicResponse>();
                 bool ret = _requestor->send(conn, msg, base_msg);
@@ -113,6 +248,59 @@ namespace zrcrpc
                 }
                 return true;
             }
+            // 流水线发送一个发布请求，先占窗口里面的一个位置，收到确认的时候归还
+            bool sendAsync(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg, const PublishCallBack &cb)
+            {
+                acquireWindow();
+                auto ack_cb = [this, cb](const BaseMessage::Ptr &rsp)
+                {
+                    auto resp_msg = std::dynamic_pointer_cast<TopicResponse>(rsp);
+                    RCode rcode = resp_msg ? resp_msg->responseCode() : RCode::INVALID_MSG;
+                    releaseWindow();
+                    if (rcode != RCode::OK)
+                        ELOG("主题消息发布失败,%s", ErrReason(rcode).c_str());
+                    if (cb)
+                        cb(rcode);
+                };
+                // 连接已经断开的时候requestor会直接用DISCONNECTED结束这个请求，确认超时的时候用TIMEOUT结束，窗口都在回调里面归还
+                if (_requestor->send(conn, msg, ack_cb, _publish_timeout.load()) == false)
+                {
+                    releaseWindow();
+                    return false;
+                }
+                return true;
+            }
+            TopicBatchRequest::Ptr makeBatchRequest(const TopicEntries &entries)
+            {
+                auto msg = MessageFactory::create<TopicBatchRequest>();
+                msg->setId(UUID::uuid());
+                msg->setMessageType(MType::REQ_TOPIC_BATCH);
+                for (auto &entry : entries)
+                    msg->addEntry(entry.first, entry.second);
+                return msg;
+            }
+            TopicRequest::Ptr makeRequest(const std::string &key, const TopicOptype &otype)
+            {
+                auto msg = MessageFactory::create<TopicRequest>();
+                msg->setId(UUID::uuid());
+                msg->setKey(key);
+                msg->setMessageType(MType::REQ_TOPIC);
+                msg->setOperationType(otype);
+                return msg;
+            }
+            void acquireWindow()
+            {
+                std::unique_lock<std::mutex> lock(_window_mutex);
+                _window_cond.wait(lock, [this]()
+                                  { return _inflight < _window; });
+                _inflight++;
+            }
+            void releaseWindow()
+            {
+                std::unique_lock<std::mutex> lock(_window_mutex);
+                _inflight--;
+                _window_cond.notify_all();
+            }
             //下面这几个函数都是给哈希使用的
             void addSubscribeCallBack(const std::string &key, const SubscribeCallBack &cb)
             {
@@ -121,6 +309,8 @@ namespace zrcrpc
                 if (it == _callbacks.end())
                 {
                     _callbacks[key] = cb;
+                    if (PatternTrie::isPattern(key))
+                        _patterns.insert(key, key);
                 }
             }
             void removeSubscribeCallBack(const std::string &key)
@@ -130,23 +320,66 @@ namespace zrcrpc
                 if (it != _callbacks.end())
                 {
                     _callbacks.erase(key);
+                    if (PatternTrie::isPattern(key))
+                        _patterns.remove(key, key);
                 }
             }
-            SubscribeCallBack getSubscribeCallBack(const std::string &key)
+            void setNextOffset(const std::string &key, uint64_t offset)
             {
                 std::unique_lock<std::mutex> lock(_mutex);
-                auto it = _callbacks.find(key);
-                if (it != _callbacks.end())
+                _offsets[key] = offset;
+            }
+            void clearNextOffset(const std::string &key)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _offsets.erase(key);
+            }
+            // offset比下一条要收的offset小的时候返回false，否则把下一条要收的offset往后移
+            bool advanceOffset(const std::string &key, uint64_t offset)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto it = _offsets.find(key);
+                if (it != _offsets.end() && offset < it->second)
+                    return false;
+                _offsets[key] = offset + 1;
+                return true;
+            }
+            // 主题自己的回调以及所有能匹配这个主题的通配订阅的回调
+            std::vector<SubscribeCallBack> getSubscribeCallBacks(const std::string &key)
+            {
+                std::vector<std::string> keys;
+                _patterns.match(key, keys);
+                keys.push_back(key);
+                // 发布的主题名本身就是一个通配订阅（比如md.*）的时候match已经把它找出来了，
+                // 像a.#.#这样的通配订阅也可能被匹配多次，去重以后每个回调只执行一次
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+                std::vector<SubscribeCallBack> cbs;
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (auto &k : keys)
                 {
-                    return _callbacks[key];
+                    auto it = _callbacks.find(k);
+                    if (it != _callbacks.end())
+                        cbs.push_back(it->second);
                 }
-                return SubscribeCallBack();
+                return cbs;
             }
 
         private:
+            using PatternTrie = TopicTrie<std::string>;
+            static const uint64_t NoOffset = UINT64_MAX; // 请求里面不带offset
+            static const size_t DefaultWindow = 4096;    // 流水线发布默认的窗口大小
+            static const int DefaultPublishTimeout = 3000; // 流水线发布默认的确认超时时间，单位毫秒
             std::mutex _mutex;
             Reuqestor::Ptr _requestor;
             std::unordered_map<std::string, SubscribeCallBack> _callbacks; // 主题--回调函数
+            PatternTrie _patterns;                                         // 通配订阅，值就是通配订阅自己，用来在_callbacks里面找回调
+            std::unordered_map<std::string, uint64_t> _offsets;            // 主题--下一条要收的offset
+            std::atomic<int> _publish_timeout; // 流水线发布等待确认的超时时间，单位毫秒
+            std::mutex _window_mutex;
+            std::condition_variable _window_cond;
+            size_t _window;   // 流水线发布的窗口大小
+            size_t _inflight; // 已经发出去还没有收到确认的流水线发布
         };
     }
 
@@ -5,6 +5,8 @@
 
 #pragma once
 #include <memory>
+#include <cstdint>
+#include <atomic>
 #include <functional>
 #include "fields.hpp"
 
@@ -17,18 +19,24 @@ namespace zrcrpc
         using Ptr = std::shared_ptr<BaseMessage>;
         virtual ~BaseMessage() = default;
         virtual zrcrpc::MType messageType() const { return message_type_; }
-        virtual std::string id() const { return id_; }
+        virtual uint64_t id() const { return id_; }
+        virtual zrcrpc::CodecType codec() const { return codec_; }
 
-        virtual void setId(const std::string &id) { id_ = id; }
+        virtual void setId(uint64_t id) { id_ = id; }
         virtual void setMessageType(const zrcrpc::MType &type) { message_type_ = type; }
+        virtual void setCodec(const zrcrpc::CodecType &codec) { codec_ = codec; } // 由协议层在解析报文的时候设置
 
         virtual std::string serialize() const = 0;
         virtual bool deserialize(const std::string &message) = 0;
+        // 按照指定的编码方式对消息主体进行序列化和反序列化，序列化的结果追加到body的末尾
+        virtual bool serialize(zrcrpc::CodecType codec, std::string &body) const = 0;
+        virtual bool deserialize(zrcrpc::CodecType codec, const char *data, size_t len) = 0;
         virtual bool isValid() const = 0;
 
     protected:
         zrcrpc::MType message_type_;
-        std::string id_;
+        uint64_t id_ = 0; // 请求和响应通过id对应起来，0表示没有设置
+        zrcrpc::CodecType codec_ = zrcrpc::CodecType::JSON; // 收到这条消息时报文使用的编码方式
     };
 
     class BaseBuffer
@@ -41,20 +49,82 @@ namespace zrcrpc
         virtual void retrieveInt32() = 0;                        // 删除缓冲区的一个int32大小
         virtual int32_t readInt32() = 0;                         // 该函数从缓冲区里面读取一个int32，并且删除一个int32，功能的peekint+retrieveint32
         virtual std::string retrieveAsString(size_t length) = 0; // 删除缓冲区的len大小的长度，并且按照字符串返回
+        virtual const char *peek() const = 0;                    // 返回可读区域的起始地址，不拷贝数据，只在下一次修改缓冲区之前有效
+        virtual void retrieve(size_t length) = 0;                // 删除缓冲区的len大小的长度，不返回数据
 
     private:
     };
 
+    // 在途请求数和请求耗时的指数加权平均值，每个连接有一份，连接池给同一个主机的所有连接再挂一份汇总
+    // 都是原子变量，负载均衡读取的时候不需要加锁
+    struct LoadCounter
+    {
+        using Ptr = std::shared_ptr<LoadCounter>;
+        std::atomic<int> _inflight{0};
+        std::atomic<int64_t> _latency_us{0}; // 微秒，0表示还没有样本
+
+        void record(int64_t us)
+        {
+            int64_t old = _latency_us.load(std::memory_order_relaxed);
+            int64_t val;
+            do
+            {
+                val = old == 0 ? us : old + (us - old) / 8; // 新样本占1/8的权重
+                if (val <= 0)
+                    val = 1;
+            } while (!_latency_us.compare_exchange_weak(old, val, std::memory_order_relaxed));
+        }
+    };
+
     class BaseConnection
     {
     public:
         using Ptr = std::shared_ptr<BaseConnection>;
+        // 编码好的完整报文，发送以后不会再被修改，同一个报文可以交给多个连接发送
+        using Frame = std::shared_ptr<const std::string>;
         virtual ~BaseConnection() noexcept = default;
         virtual void send(const BaseMessage::Ptr &message) = 0;
+        // 按照这个连接的编码方式把消息编码成报文，编码方式相同的连接可以共用同一个报文，比如主题消息的广播
+        virtual Frame frame(const BaseMessage::Ptr &message) const = 0;
+        virtual void sendFrame(const Frame &frame) = 0;
         virtual void shutdown() = 0;
+        // 不等待输出缓冲区里面的数据写完，直接关闭连接，用来断开卡住不读数据的对端
+        virtual void forceClose() { shutdown(); }
         virtual bool isConnected() const = 0;
+        // 连接已经断开或者连接失败，不会再变成可用状态；还在建立连接的时候既不是connected也不是closed
+        virtual bool isClosed() const = 0;
+        // 在这个连接所属的IO线程里面delay秒以后执行一次task
+        virtual void runAfter(double delay, const std::function<void()> &task) = 0;
+        // 这个连接发送消息时使用的编码方式
+        virtual CodecType codec() const = 0;
+        virtual void setCodec(CodecType codec) = 0;
+        // 已经发出去还没有收到响应的请求数量，由客户端的Reuqestor维护，连接池按照它选择最空闲的连接
+        int inflight() const { return _load._inflight.load(std::memory_order_relaxed); }
+        void addInflight(int n)
+        {
+            _load._inflight.fetch_add(n, std::memory_order_relaxed);
+            if (_host_load)
+                _host_load->_inflight.fetch_add(n, std::memory_order_relaxed);
+        }
+        // 请求耗时的指数加权平均值（微秒），同样由Reuqestor在请求结束的时候更新，0表示还没有样本
+        int64_t latency() const { return _load._latency_us.load(std::memory_order_relaxed); }
+        // 连接池在连接开始使用之前设置，之后这个连接的负载变化同时累加到主机的汇总上
+        void setHostLoad(const LoadCounter::Ptr &host_load) { _host_load = host_load; }
+        // 输出缓冲区超过了高水位还没有写完，由服务端在高水位回调和写完成回调里面维护
+        bool congested() const { return _congested.load(std::memory_order_acquire); }
+        // 状态发生变化的时候返回true
+        bool setCongested(bool congested) { return _congested.exchange(congested) != congested; }
+        void recordLatency(int64_t us)
+        {
+            _load.record(us);
+            if (_host_load)
+                _host_load->record(us);
+        }
 
     private:
+        LoadCounter _load;
+        LoadCounter::Ptr _host_load;
+        std::atomic<bool> _congested{false};
     };
 
     class BaseProtocol
@@ -65,7 +135,7 @@ namespace zrcrpc
         virtual ~BaseProtocol() = default;
         virtual bool canProcess(const BaseBuffer::Ptr &buffer) const = 0;
         virtual bool onMessage(const BaseBuffer::Ptr &buffer, BaseMessage::Ptr &message) = 0;
-        virtual std::string serialize(const BaseMessage::Ptr &message) const = 0;
+        virtual std::string serialize(const BaseMessage::Ptr &message, CodecType codec) const = 0;
 
     private:
     };
@@ -73,6 +143,8 @@ namespace zrcrpc
     using ConnectionCallback = std::function<void(const BaseConnection::Ptr &)>;
     using CloseCallback = std::function<void(const BaseConnection::Ptr &)>;
     using MessageCallback = std::function<void(const BaseConnection::Ptr &, const BaseMessage::Ptr &)>;
+    using TimerCallback = std::function<void()>;
+    using CongestionCallback = std::function<void(const BaseConnection::Ptr &, bool)>; // 连接变得拥塞或者恢复的时候调用
 
     class BaseServer
     {
@@ -92,12 +164,22 @@ namespace zrcrpc
         {
             message_callback_ = callback;
         }
+        // 连接的输出缓冲区超过high_water_mark字节的时候以true调用，数据全部写完以后以false调用，必须在start之前设置
+        virtual void setCongestionCallback(size_t high_water_mark, const CongestionCallback &callback)
+        {
+            high_water_mark_ = high_water_mark;
+            congestion_callback_ = callback;
+        }
+        // 设置IO线程的数量，必须在start之前调用；0表示所有连接都在主循环里面处理
+        virtual void setThreadNum(int num) = 0;
         virtual void start() = 0;
 
     protected:
         ConnectionCallback connection_callback_;
         CloseCallback close_callback_;
         MessageCallback message_callback_;
+        CongestionCallback congestion_callback_;
+        size_t high_water_mark_ = 0;
     };
 
     class BaseClient
@@ -117,11 +199,17 @@ namespace zrcrpc
         {
             message_callback_ = callback;
         }
+        // 阻塞直到连接建立
         virtual void connect() = 0;
+        // 发起连接以后立即返回，connection()马上就可以使用，连接建立之前发送的消息会排队，建立以后按顺序发出
+        // timeout_ms大于0的时候，超时还没有连上就关闭连接并且调用close回调，排队的消息被丢弃
+        virtual void connectAsync(int timeout_ms) = 0;
         virtual void send(const BaseMessage::Ptr &message) = 0;
         virtual void shutdown() = 0;
         virtual bool isConnected() const = 0;
         virtual BaseConnection::Ptr connection() const = 0;
+        // 在客户端的事件循环里面每隔interval秒执行一次task，比如驱动请求超时的时间轮
+        virtual void runEvery(double interval, const TimerCallback &task) = 0;
 
     protected:
         ConnectionCallback connection_callback_;
@@ -1,7 +1,8 @@
 /*
     1、实现日志宏的定义
     2、json的序列化和反序列化
-    3、uuid的生成
+    3、Json::Value的二进制序列化和反序列化
+    4、uuid的生成
 */
 #pragma once
 #include <stdio.h>
@@ -15,6 +16,8 @@
 #include <iomanip>
 #include <chrono>
 #include <random>
+#include <cstring>
+#include "fields.hpp"
 namespace zrcrpc
 {
 
@@ -49,23 +52,32 @@ namespace zrcrpc
         // 实现数据的序列化
         static bool serialize(const Json::Value &val, std::string &body)
         {
-            std::stringstream ss;
-            // 先实例化⼀个⼯⼚类对象
-            Json::StreamWriterBuilder swb;
-            // 通过⼯⼚类对象来⽣产派⽣类对象
-            std::unique_ptr<Json::StreamWriter> sw(swb.newStreamWriter());
+            body.clear();
+            return append(val, body);
+        }
+        // 序列化以后直接追加到out的末尾，不经过stringstream的中间拷贝
+        static bool append(const Json::Value &val, std::string &out)
+        {
+            // 每个线程缓存一个StreamWriter，不需要每次都通过⼯⼚类对象来⽣产
+            static thread_local std::unique_ptr<Json::StreamWriter> sw(Json::StreamWriterBuilder().newStreamWriter());
+            StringAppender appender(out);
+            std::ostream os(&appender);
             // 将Json::Value类型的数据变为字符串
-            int ret = sw->write(val, &ss);
+            int ret = sw->write(val, &os);
             if (ret != 0)
             {
                 ELOG("json serialize failed");
                 return false;
             }
-            body = ss.str();
             return true;
         }
         // 实现json字符串的反序列化
         static bool deserialize(const std::string &body, Json::Value &val)
+        {
+            return deserialize(body.c_str(), body.size(), val);
+        }
+        // 直接解析一段内存，比如网络缓冲区里面的数据，不需要先拷贝成字符串
+        static bool deserialize(const char *data, size_t len, Json::Value &val)
         {
             // 实例化⼯⼚类对象
             Json::CharReaderBuilder crb;
@@ -73,7 +85,7 @@ namespace zrcrpc
             std::string errs;
             std::unique_ptr<Json::CharReader> cr(crb.newCharReader());
             // 将body字符串解析为Json::Value的格式，放入到val里面
-            bool ret = cr->parse(body.c_str(), body.c_str() + body.size(), &val,
+            bool ret = cr->parse(data, data + len, &val,
                                  &errs);
             if (ret == false)
             {
@@ -82,46 +94,329 @@ namespace zrcrpc
             }
             return true;
         }
+
+    private:
+        // 把ostream的输出直接追加到一个string的末尾
+        class StringAppender : public std::streambuf
+        {
+        public:
+            explicit StringAppender(std::string &out) : _out(out) {}
+
+        protected:
+            int_type overflow(int_type ch) override
+            {
+                if (ch != traits_type::eof())
+                    _out.push_back(traits_type::to_char_type(ch));
+                return traits_type::not_eof(ch);
+            }
+            std::streamsize xsputn(const char *data, std::streamsize len) override
+            {
+                _out.append(data, len);
+                return len;
+            }
+
+        private:
+            std::string &_out;
+        };
     };
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    class UUID
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    class BINARY
     {
+        /*
+            Json::Value的紧凑二进制编码，不经过jsoncpp的文本写入和解析，格式如下：
+            每个值 = |--tag(1字节)--|--数据--|
+                整数使用zigzag+varint，无符号整数使用varint，浮点数固定8字节小端序，字符串为|--varint长度--|--内容--|
+                数组为|--varint个数--|--值...--|，对象为|--varint个数--|--(键,值)...--|
+            对象的键 = varint编号，编号不为0的时候表示_keys表里面的第编号-1个字段，为0的时候后面跟着|--varint长度--|--键名--|
+            这里只替换了报文body的编码，所有消息仍然是JsonMessage，收发的时候还是会构造和遍历Json::Value，
+            省掉的是文本的格式化和解析，以及报文的体积
+        */
     public:
-        static std::string uuid()
-        {
-            std::stringstream ss;
-            // 1. 创建机器随机数对象
-            std::random_device rd;
-            // 2. 用rd生成的机器随机数为种子构造伪随机数
-            std::mt19937 generator(rd());
-            // 3.限定构造随机数的范围
-            std::uniform_int_distribution<int> distribution(0, 255); // 保证8进制的随机数都是两位的范围
-            // 4. 生成8个随机数，并且转换为八进制形式，每个八进制形式为2位
-            for (int i = 0; i < 8; i++)
-            {
-                if (i == 4 || i == 6)
+        // 实现数据的序列化
+        static bool serialize(const Json::Value &val, std::string &body)
+        {
+            body.clear();
+            return append(val, body);
+        }
+        // 序列化以后直接追加到out的末尾
+        static bool append(const Json::Value &val, std::string &out)
+        {
+            encodeValue(val, out);
+            return true;
+        }
+        // 实现二进制数据的反序列化
+        static bool deserialize(const char *data, size_t len, Json::Value &val)
+        {
+            const char *end = data + len;
+            if (!decodeValue(data, end, val, 0) || data != end)
+            {
+                ELOG("binary unserialize failed");
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        enum Tag
+        {
+            TAG_NULL = 0,
+            TAG_FALSE,
+            TAG_TRUE,
+            TAG_INT,
+            TAG_UINT,
+            TAG_DOUBLE,
+            TAG_STRING,
+            TAG_ARRAY,
+            TAG_OBJECT
+        };
+        static const int MaxDepth = 256; // 防止恶意的深层嵌套把栈打爆
+
+        // 常用字段的字典，编码的时候只写编号，这张表只能在末尾追加，不能修改已有的顺序
+        static const char *const *keys(size_t &count)
+        {
+            static const char *const table[] = {KEY_METHOD, KEY_PARAMS, KEY_TOPIC_KEY, KEY_TOPIC_MSG, KEY_OPTYPE,
+                                                KEY_HOST, KEY_HOST_IP, KEY_HOST_PORT, KEY_RCODE, KEY_RESULT, KEY_TIMEOUT,
+                                                KEY_CALLS, KEY_OFFSET, KEY_NO_ACK, KEY_ENTRIES};
+            count = sizeof(table) / sizeof(table[0]);
+            return table;
+        }
+        static size_t keyIndex(const char *key, size_t len)
+        {
+            size_t count = 0;
+            const char *const *table = keys(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                if (strlen(table[i]) == len && memcmp(table[i], key, len) == 0)
+                    return i + 1;
+            }
+            return 0;
+        }
+
+        static void encodeVarint(uint64_t v, std::string &out)
+        {
+            char tmp[10];
+            int n = 0;
+            while (v >= 0x80)
+            {
+                tmp[n++] = static_cast<char>((v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            tmp[n++] = static_cast<char>(v);
+            out.append(tmp, n);
+        }
+        static bool decodeVarint(const char *&p, const char *end, uint64_t &v)
+        {
+            v = 0;
+            for (int shift = 0; shift < 64 && p < end; shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(*p++);
+                v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                    return true;
+            }
+            return false;
+        }
+        static void encodeString(const char *str, size_t len, std::string &out)
+        {
+            encodeVarint(len, out);
+            out.append(str, len);
+        }
+        static bool decodeString(const char *&p, const char *end, const char *&str, size_t &len)
+        {
+            uint64_t n = 0;
+            if (!decodeVarint(p, end, n) || n > static_cast<uint64_t>(end - p))
+                return false;
+            str = p;
+            len = static_cast<size_t>(n);
+            p += len;
+            return true;
+        }
+
+        static void encodeValue(const Json::Value &val, std::string &out)
+        {
+            switch (val.type())
+            {
+            case Json::nullValue:
+                out.push_back(TAG_NULL);
+                break;
+            case Json::booleanValue:
+                out.push_back(val.asBool() ? TAG_TRUE : TAG_FALSE);
+                break;
+            case Json::intValue:
+            {
+                int64_t v = val.asInt64();
+                out.push_back(TAG_INT);
+                encodeVarint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63), out); // zigzag
+                break;
+            }
+            case Json::uintValue:
+                out.push_back(TAG_UINT);
+                encodeVarint(val.asUInt64(), out);
+                break;
+            case Json::realValue:
+            {
+                double d = val.asDouble();
+                uint64_t bits = 0;
+                memcpy(&bits, &d, sizeof(d));
+                out.push_back(TAG_DOUBLE);
+                for (size_t i = 0; i < sizeof(bits); i++) // 按小端序写，和机器的字节序无关
+                    out.push_back(static_cast<char>((bits >> (8 * i)) & 0xff));
+                break;
+            }
+            case Json::stringValue:
+            {
+                const char *begin = nullptr;
+                const char *end = nullptr;
+                val.getString(&begin, &end);
+                out.push_back(TAG_STRING);
+                encodeString(begin, end - begin, out);
+                break;
+            }
+            case Json::arrayValue:
+                out.push_back(TAG_ARRAY);
+                encodeVarint(val.size(), out);
+                for (Json::ArrayIndex i = 0; i < val.size(); i++)
                 {
-                    ss << '-';
+                    encodeValue(val[i], out);
                 }
-                ss << std::setw(2) << std::setfill('0') << std::hex << distribution(generator);
+                break;
+            case Json::objectValue:
+                out.push_back(TAG_OBJECT);
+                encodeVarint(val.size(), out);
+                for (auto it = val.begin(); it != val.end(); ++it)
+                {
+                    const char *end = nullptr;
+                    const char *key = it.memberName(&end);
+                    size_t index = keyIndex(key, end - key);
+                    encodeVarint(index, out);
+                    if (index == 0)
+                        encodeString(key, end - key, out);
+                    encodeValue(*it, out);
+                }
+                break;
             }
-            ss << '-';
+        }
 
-            // 生成8字节序号 总共就是2*(8*8)-1的范围，冲突可能性很小
-            //  8*8总共64bit位，每次取出一个字节出来加入字符串
-            // 这里使用atomic库来保证字节的原子性递增
-            std::atomic<size_t> seq(1);
-            size_t cur = seq.fetch_add(1); // 这个方法会原子地将 seq 的当前值加上 1，并且返回 seq 的旧值
-            for (int i = 7; i >= 0; i--)   // 从高位到地位的加入字符串中
+        static bool decodeValue(const char *&p, const char *end, Json::Value &val, int depth)
+        {
+            if (p >= end || depth > MaxDepth)
+                return false;
+            uint8_t tag = static_cast<uint8_t>(*p++);
+            uint64_t n = 0;
+            switch (tag)
+            {
+            case TAG_NULL:
+                val = Json::Value();
+                return true;
+            case TAG_FALSE:
+            case TAG_TRUE:
+                val = (tag == TAG_TRUE);
+                return true;
+            case TAG_INT:
+                if (!decodeVarint(p, end, n))
+                    return false;
+                val = static_cast<Json::Int64>((n >> 1) ^ (~(n & 1) + 1)); // zigzag
+                return true;
+            case TAG_UINT:
+                if (!decodeVarint(p, end, n))
+                    return false;
+                val = static_cast<Json::UInt64>(n);
+                return true;
+            case TAG_DOUBLE:
             {
-                if (i == 5)
-                    ss << '-';
-                ss << std::setw(2) << std::setfill('0') << std::hex << (cur >> (i * 8) & 0xff);
+                double d = 0;
+                uint64_t bits = 0;
+                if (static_cast<size_t>(end - p) < sizeof(bits))
+                    return false;
+                for (size_t i = 0; i < sizeof(bits); i++)
+                    bits |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+                memcpy(&d, &bits, sizeof(d));
+                p += sizeof(bits);
+                val = d;
+                return true;
             }
+            case TAG_STRING:
+            {
+                const char *str = nullptr;
+                size_t len = 0;
+                if (!decodeString(p, end, str, len))
+                    return false;
+                val = Json::Value(str, str + len);
+                return true;
+            }
+            case TAG_ARRAY:
+            {
+                if (!decodeVarint(p, end, n) || n > static_cast<uint64_t>(end - p)) // 每个元素至少一个字节
+                    return false;
+                val = Json::Value(Json::arrayValue);
+                val.resize(static_cast<Json::ArrayIndex>(n));
+                for (Json::ArrayIndex i = 0; i < n; i++)
+                {
+                    if (!decodeValue(p, end, val[i], depth + 1))
+                        return false;
+                }
+                return true;
+            }
+            case TAG_OBJECT:
+            {
+                if (!decodeVarint(p, end, n) || n > static_cast<uint64_t>(end - p))
+                    return false;
+                val = Json::Value(Json::objectValue);
+                size_t count = 0;
+                const char *const *table = keys(count);
+                for (uint64_t i = 0; i < n; i++)
+                {
+                    uint64_t index = 0;
+                    if (!decodeVarint(p, end, index) || index > count)
+                        return false;
+                    if (index != 0) // 字典里面的字段，键名是静态字符串，不需要拷贝
+                    {
+                        if (!decodeValue(p, end, val[Json::StaticString(table[index - 1])], depth + 1))
+                            return false;
+                        continue;
+                    }
+                    const char *key = nullptr;
+                    size_t len = 0;
+                    if (!decodeString(p, end, key, len))
+                        return false;
+                    if (!decodeValue(p, end, val[std::string(key, len)], depth + 1))
+                        return false;
+                }
+                return true;
+            }
+            }
+            return false;
+        }
+    };
 
-            return ss.str();
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // 请求id生成器：每个线程持有自己的序号，生成id的时候不需要加锁，也不需要原子操作
+    // |--线程编号(高24位)--|--线程内序号(低40位)--|
+    // 线程编号在线程第一次生成id的时候从全局计数器里面取一次，保证不同线程生成的id不会重复
+    // 线程编号从1开始，所以生成的id永远不会是0，0留给没有设置id的消息
+    class UUID
+    {
+    public:
+        static uint64_t uuid()
+        {
+            static thread_local uint64_t prefix = nextThreadSlot() << _seqBits;
+            static thread_local uint64_t seq = 0;
+            seq = (seq + 1) & _seqMask;
+            return prefix | seq;
         }
+
+    private:
+        static uint64_t nextThreadSlot()
+        {
+            static std::atomic<uint64_t> slot(0);
+            return (slot.fetch_add(1) % _slotLimit) + 1;
+        }
+
+    private:
+        static const int _seqBits = 40;
+        static const uint64_t _seqMask = (1ULL << _seqBits) - 1;
+        static const uint64_t _slotLimit = (1ULL << (64 - _seqBits)) - 1;
     };
 
 }
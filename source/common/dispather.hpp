@@ -1,7 +1,8 @@
 #pragma once
 #include "net.hpp"
 #include "message.hpp"
-#include <unordered_map>
+#include <atomic>
+#include <vector>
 
 /*
     该模块的核心就是根据消息类型，提供对应的消息处理回调函数即可
@@ -30,59 +31,79 @@ namespace zrcrpc
             : _handler(handler)
         {
         }
+        // 消息是MessageFactory按照报文里面的MType创建的，而回调函数也是按照MType注册的，所以消息的实际类型一定是T
+        // 这里直接用static_pointer_cast，不需要每条消息都做一次RTTI检查
         virtual void onMessage(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg) override
         {
-            auto type_msg = std::dynamic_pointer_cast<T>(msg);
-            _handler(conn, type_msg);
+            _handler(conn, std::static_pointer_cast<T>(msg));
         }
 
     private:
         MessageCallback _handler;
     };
 
-        class Dispatcher
+    class Dispatcher
     {
     public:
+        /*
+            回调表在服务启动之前注册完成，启动以后只读：
+            1、表就是一个按照MType下标直接访问的数组，不需要哈希查找
+            2、数组里面放的是原子的裸指针，onMessage只做一次acquire读，不加锁，多个IO线程可以同时分发消息
+            3、回调对象的生命周期由_owners管理，注册以后就不会再释放，所以裸指针一直有效
+        */
         using Ptr = std::shared_ptr<Dispatcher>;
 
+        Dispatcher()
+        {
+            for (auto &slot : _call_backs)
+                slot.store(nullptr, std::memory_order_relaxed);
+        }
+
         // 这里的T代表对应消息的具体的类，比如RpcRequest、TopicResponse等等
-        // 这里如果是模板，那么就会插入多种类型到哈希map里面，这样不允许的
+        // 这里如果是模板，那么就会插入多种类型到表里面，这样不允许的
         // 为了解决这样的问题，将T进行封装，封装到一个CallBack类里面，这样就不会存在多种的T了
         // 但是这样发现，传入的callback还是会因为T的不同生成不同类型的T
         // 解决办法就是再次使用多态，父类指针指向由模板实例化出来的不同类型的T，然后调用函数，就不在单独传入类了，传入类的指针去调用
         template <typename T> // 下面应该根据传入的函数类型构造响应的回调函数
         void registryCallBack(const MType &mtype, const typename CallBackTemplate<T>::MessageCallback &handler)
         {
-            std::unique_lock<std::mutex> lock(_mutex);
-            auto it = _call_backs.find(mtype);
-            if (it == _call_backs.end())
+            size_t index = static_cast<size_t>(mtype);
+            if (index >= MaxMType)
             {
-                auto cb = std::make_shared<CallBackTemplate<T>>(handler);
-                _call_backs[mtype] = cb;
-                DLOG("回调函数注册完毕");
+                ELOG("消息类型超出回调表的范围");
                 return;
             }
+            // 注册只在启动阶段发生，这里的锁只用来保护_owners，分发消息的时候不会用到
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_call_backs[index].load(std::memory_order_relaxed) != nullptr)
+                return; // 已经注册过的类型保持原来的回调函数
+            auto cb = std::make_shared<CallBackTemplate<T>>(handler);
+            _owners.push_back(cb);
+            _call_backs[index].store(cb.get(), std::memory_order_release);
+            DLOG("回调函数注册完毕");
         }
 
         // 该onMessage函数就是向外部提供的，根据传入的消息类型，找到自己的回调函数，传入参数，返回即可
         void onMessage(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg)
         {
-            std::unique_lock<std::mutex> lock(_mutex);
-            auto it = _call_backs.find(msg->messageType());
-            if (it == _call_backs.end())
+            size_t index = static_cast<size_t>(msg->messageType());
+            CallBack *cb = index < MaxMType ? _call_backs[index].load(std::memory_order_acquire) : nullptr;
+            if (cb == nullptr)
             {
                 ELOG("回调函数未注册");
                 conn->shutdown();
                 return;
             }
             // 这里调用了callbacktemplate里面的onmessage去设置成员变量
-            it->second->onMessage(conn, msg);
-            return;
+            cb->onMessage(conn, msg);
         }
 
     private:
-        std::mutex _mutex; // 为了保护下面的哈希映射
-        std::unordered_map<MType, CallBack::Ptr> _call_backs;
+        static const size_t MaxMType = 16; // 回调表的大小，MType的取值必须小于这个值
+
+        std::mutex _mutex;                     // 只保护注册过程
+        std::vector<CallBack::Ptr> _owners;    // 持有注册过的回调对象，保证表里面的裸指针一直有效
+        std::atomic<CallBack *> _call_backs[MaxMType];
     };
 
     class DispatcherFactory
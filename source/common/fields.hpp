@@ -19,6 +19,18 @@ namespace zrcrpc
 #define KEY_HOST_PORT "port"
 #define KEY_RCODE "rcode"
 #define KEY_RESULT "result"
+#define KEY_TIMEOUT "timeout"
+#define KEY_CALLS "calls"
+#define KEY_OFFSET "offset"
+#define KEY_NO_ACK "no_ack"
+#define KEY_ENTRIES "entries"
+
+    // 消息主体的编码方式，编码方式会写在报文头里面，接收方根据报文头来选择解码方式
+    enum class CodecType
+    {
+        JSON = 0, // jsoncpp文本格式
+        BINARY    // 紧凑的二进制格式
+    };
 
     // 消息的操作类型
     enum class MType
@@ -28,7 +40,10 @@ namespace zrcrpc
         REQ_TOPIC, // 主题的请求和响应
         RSP_TOPIC,
         REQ_SERVICE, // 服务的请求和响应
-        RSP_SERVICE
+        RSP_SERVICE,
+        REQ_BATCH_RPC, // 一个报文里面携带多个RPC调用，以及对应的批量响应
+        RSP_BATCH_RPC,
+        REQ_TOPIC_BATCH // 一个报文里面携带多条主题消息，发布的时候发给服务端，推送的时候发给订阅者，响应还是RSP_TOPIC
     };
     enum class RCode
     {
@@ -41,7 +56,9 @@ namespace zrcrpc
         NOT_FOUND_SERVICE, // 服务不存在
         INVALID_OPTYPE,    // 无效主题类型
         NOT_FOUND_TOPIC,   // 主题不存在
-        INTERNAL_ERROR
+        INTERNAL_ERROR,
+        TIMEOUT,          // 在截止时间之前没有收到响应
+        DEADLINE_EXCEEDED // 服务端开始处理的时候请求已经过了截止时间
     };
     static std::string ErrReason(RCode code)
     {
@@ -56,7 +73,9 @@ namespace zrcrpc
                 {RCode::NOT_FOUND_SERVICE, "没有找到对应的服务！"},
                 {RCode::INVALID_OPTYPE, "无效的操作类型"},
                 {RCode::NOT_FOUND_TOPIC, "没有找到对应的主题！"},
-                {RCode::INTERNAL_ERROR, "内部错误！"}};
+                {RCode::INTERNAL_ERROR, "内部错误！"},
+                {RCode::TIMEOUT, "请求超时！"},
+                {RCode::DEADLINE_EXCEEDED, "请求已经超过截止时间，服务端放弃处理！"}};
         auto it = err_map.find(code);
         if (it == err_map.end())
         {
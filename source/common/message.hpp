@@ -37,6 +37,21 @@ namespace zrcrpc
             return JSON::deserialize(message, body_);
         }
 
+        // 按照编码方式选择文本格式或者二进制格式，两种格式的消息主体都是body_，上层的访问接口不受影响
+        // 结果直接追加到body的末尾，协议层可以先写好报头，再让消息主体接在后面
+        bool serialize(CodecType codec, std::string &body) const override
+        {
+            if (codec == CodecType::BINARY)
+                return BINARY::append(body_, body);
+            return JSON::append(body_, body);
+        }
+        bool deserialize(CodecType codec, const char *data, size_t len) override
+        {
+            if (codec == CodecType::BINARY)
+                return BINARY::deserialize(data, len, body_);
+            return JSON::deserialize(data, len, body_);
+        }
+
     protected:
         Json::Value body_;
     };
@@ -52,7 +67,7 @@ namespace zrcrpc
     class RpcRequest : public JsonRequest
     {
     public:
-        /* 消息的body里面存在两个属性：method、parameters */
+        /* 消息的body里面存在两个属性：method、parameters，以及可选的timeout */
         using Ptr = std::shared_ptr<RpcRequest>;
 
         bool isValid() const override
@@ -67,6 +82,12 @@ namespace zrcrpc
                 ELOG("RPC request params are missing or not an object");
                 return false;
             }
+            // 超过int范围的值在asInt的时候会抛异常，负数也没有意义，都当作无效消息
+            if (!body_[KEY_TIMEOUT].isNull() && (!body_[KEY_TIMEOUT].isInt() || body_[KEY_TIMEOUT].asInt() < 0))
+            {
+                ELOG("RPC request timeout is not a non-negative int");
+                return false;
+            }
             return true;
         }
 
@@ -74,6 +95,72 @@ namespace zrcrpc
         void setMethod(const std::string &method) { body_[KEY_METHOD] = method; }
         Json::Value params() const { return body_[KEY_PARAMS]; }
         void setParams(const Json::Value &params) { body_[KEY_PARAMS] = params; }
+        // 调用方还愿意等待的毫秒数，使用相对时间，两端的时钟不需要同步；没有这个字段的时候返回0，表示不限时
+        int timeout() const
+        {
+            // 不是合法的int或者是负数的时候按照不限时处理，isValid会把这样的请求拒绝掉，这里只保证不会抛异常
+            const Json::Value &val = body_[KEY_TIMEOUT];
+            return (val.isInt() && val.asInt() > 0) ? val.asInt() : 0;
+        }
+        void setTimeout(int timeout_ms) { body_[KEY_TIMEOUT] = timeout_ms; }
+
+    private:
+    };
+
+    class BatchRpcRequest : public JsonRequest
+    {
+    public:
+        /*
+            消息的body里面存在calls数组，以及可选的timeout
+            calls里面的每一项和RpcRequest的body一样，都有method、parameters两个属性
+            一个批量请求里面的调用都发给同一个服务提供者，按照数组的下标和响应里面的结果一一对应
+        */
+        using Ptr = std::shared_ptr<BatchRpcRequest>;
+
+        bool isValid() const override
+        {
+            if (body_[KEY_CALLS].isNull() || !body_[KEY_CALLS].isArray() || body_[KEY_CALLS].empty())
+            {
+                ELOG("Batch RPC request calls are missing or empty");
+                return false;
+            }
+            for (const auto &call : body_[KEY_CALLS])
+            {
+                if (!call.isObject() ||
+                    call[KEY_METHOD].isNull() || !call[KEY_METHOD].isString() ||
+                    call[KEY_PARAMS].isNull() || !call[KEY_PARAMS].isObject())
+                {
+                    ELOG("Batch RPC request call is missing method or params");
+                    return false;
+                }
+            }
+            // 超过int范围的值在asInt的时候会抛异常，负数也没有意义，都当作无效消息
+            if (!body_[KEY_TIMEOUT].isNull() && (!body_[KEY_TIMEOUT].isInt() || body_[KEY_TIMEOUT].asInt() < 0))
+            {
+                ELOG("Batch RPC request timeout is not a non-negative int");
+                return false;
+            }
+            return true;
+        }
+
+        size_t size() const { return body_[KEY_CALLS].size(); }
+        std::string method(size_t i) const { return body_[KEY_CALLS][(Json::ArrayIndex)i][KEY_METHOD].asString(); }
+        Json::Value params(size_t i) const { return body_[KEY_CALLS][(Json::ArrayIndex)i][KEY_PARAMS]; }
+        void addCall(const std::string &method, const Json::Value &params)
+        {
+            Json::Value call;
+            call[KEY_METHOD] = method;
+            call[KEY_PARAMS] = params;
+            body_[KEY_CALLS].append(call);
+        }
+        // 整个批量请求的截止时间，含义和RpcRequest一样
+        int timeout() const
+        {
+            // 不是合法的int或者是负数的时候按照不限时处理，isValid会把这样的请求拒绝掉，这里只保证不会抛异常
+            const Json::Value &val = body_[KEY_TIMEOUT];
+            return (val.isInt() && val.asInt() > 0) ? val.asInt() : 0;
+        }
+        void setTimeout(int timeout_ms) { body_[KEY_TIMEOUT] = timeout_ms; }
 
     private:
     };
@@ -82,6 +169,8 @@ namespace zrcrpc
     {
     public:
         /*消息的body里面存在两个属性：key、otype、msg (  msg属于是只有otype==TOPIC_PUBLISH  才会使用这个字段) */
+        /*offset是可选的：服务端推送的消息里面是这条消息在主题日志里面的位置，订阅请求里面是从哪个位置开始接收 */
+        /*no_ack是可选的：为true的时候服务端处理完不返回响应，出错也只在服务端记录日志 */
 
         using Ptr = std::shared_ptr<TopicRequest>;
 
@@ -103,6 +192,16 @@ namespace zrcrpc
                 ELOG("Topic message is missing or not a string");
                 return false;
             }
+            if (hasOffset() && !body_[KEY_OFFSET].isUInt64())
+            {
+                ELOG("Topic offset is not an unsigned integer");
+                return false;
+            }
+            if (!body_[KEY_NO_ACK].isNull() && !body_[KEY_NO_ACK].isBool())
+            {
+                ELOG("Topic no_ack is not a bool");
+                return false;
+            }
             return true;
         }
 
@@ -112,11 +211,93 @@ namespace zrcrpc
         void setMessage(const std::string &message) { body_[KEY_TOPIC_MSG] = message; }
         TopicOptype operationType() const { return static_cast<TopicOptype>(body_[KEY_OPTYPE].asInt()); }
         void setOperationType(TopicOptype operation_type) { body_[KEY_OPTYPE] = static_cast<int>(operation_type); }
+        bool hasOffset() const { return !body_[KEY_OFFSET].isNull(); }
+        uint64_t offset() const { return body_[KEY_OFFSET].asUInt64(); }
+        void setOffset(uint64_t offset) { body_[KEY_OFFSET] = static_cast<Json::UInt64>(offset); }
+        bool noAck() const { return body_[KEY_NO_ACK].asBool(); }
+        void setNoAck(bool no_ack) { body_[KEY_NO_ACK] = no_ack; }
+
+    private:
+    };
+
+    class TopicBatchRequest : public JsonRequest
+    {
+    public:
+        /*
+            消息的body里面存在entries数组，以及可选的no_ack
+            entries里面的每一项都是一条主题消息，有topic_key、topic_msg两个属性，服务端推送的时候还可能带着offset
+            发布的时候一个批量请求只返回一个响应，所有的消息都发布成功才是OK
+        */
+        using Ptr = std::shared_ptr<TopicBatchRequest>;
+
+        bool isValid() const override
+        {
+            if (body_[KEY_ENTRIES].isNull() || !body_[KEY_ENTRIES].isArray() || body_[KEY_ENTRIES].empty())
+            {
+                ELOG("Topic batch entries are missing or empty");
+                return false;
+            }
+            for (const auto &entry : body_[KEY_ENTRIES])
+            {
+                if (!entry.isObject() ||
+                    entry[KEY_TOPIC_KEY].isNull() || !entry[KEY_TOPIC_KEY].isString() ||
+                    entry[KEY_TOPIC_MSG].isNull() || !entry[KEY_TOPIC_MSG].isString())
+                {
+                    ELOG("Topic batch entry is missing key or message");
+                    return false;
+                }
+                if (!entry[KEY_OFFSET].isNull() && !entry[KEY_OFFSET].isUInt64())
+                {
+                    ELOG("Topic batch entry offset is not an unsigned integer");
+                    return false;
+                }
+            }
+            if (!body_[KEY_NO_ACK].isNull() && !body_[KEY_NO_ACK].isBool())
+            {
+                ELOG("Topic batch no_ack is not a bool");
+                return false;
+            }
+            return true;
+        }
+
+        size_t size() const { return body_[KEY_ENTRIES].size(); }
+        std::string key(size_t i) const { return body_[KEY_ENTRIES][(Json::ArrayIndex)i][KEY_TOPIC_KEY].asString(); }
+        std::string message(size_t i) const { return body_[KEY_ENTRIES][(Json::ArrayIndex)i][KEY_TOPIC_MSG].asString(); }
+        bool hasOffset(size_t i) const { return !body_[KEY_ENTRIES][(Json::ArrayIndex)i][KEY_OFFSET].isNull(); }
+        uint64_t offset(size_t i) const { return body_[KEY_ENTRIES][(Json::ArrayIndex)i][KEY_OFFSET].asUInt64(); }
+        void addEntry(const std::string &key, const std::string &message)
+        {
+            Json::Value entry;
+            entry[KEY_TOPIC_KEY] = key;
+            entry[KEY_TOPIC_MSG] = message;
+            body_[KEY_ENTRIES].append(entry);
+        }
+        void addEntry(const std::string &key, const std::string &message, uint64_t offset)
+        {
+            Json::Value entry;
+            entry[KEY_TOPIC_KEY] = key;
+            entry[KEY_TOPIC_MSG] = message;
+            entry[KEY_OFFSET] = static_cast<Json::UInt64>(offset);
+            body_[KEY_ENTRIES].append(entry);
+        }
+        bool noAck() const { return body_[KEY_NO_ACK].asBool(); }
+        void setNoAck(bool no_ack) { body_[KEY_NO_ACK] = no_ack; }
 
     private:
     };
 
     using Address = std::pair<std::string, int>; // ip-- port
+    struct AddressHash
+    {
+        size_t operator()(const Address &host) const
+        {
+            // 使用 std::hash 计算各字段的哈希值
+            size_t h1 = std::hash<std::string>{}(host.first); // IP 地址
+            size_t h2 = std::hash<int>{}(host.second);        // 端口号
+
+            return h1 ^ (h2 << 1); // 简单组合
+        }
+    };
 
     class ServiceRequest : public JsonRequest
     {
@@ -218,6 +399,53 @@ namespace zrcrpc
     private:
     };
 
+    class BatchRpcResponse : public JsonResponse
+    {
+    public:
+        /*
+            消息的body里面存在两个属性：rcode、result
+            rcode是整个批量请求的处理结果，result数组里面每一项都有自己的rcode和result，对应请求里面同一个下标的调用
+        */
+        using Ptr = std::shared_ptr<BatchRpcResponse>;
+
+        bool isValid() const override
+        {
+            if (body_[KEY_RCODE].isNull() || !body_[KEY_RCODE].isIntegral())
+            {
+                ELOG("Batch RPC response rcode is missing or not an integer");
+                return false;
+            }
+            if (!body_[KEY_RESULT].isNull() && !body_[KEY_RESULT].isArray())
+            {
+                ELOG("Batch RPC response result is not an array");
+                return false;
+            }
+            for (const auto &item : body_[KEY_RESULT])
+            {
+                if (!item.isObject() || item[KEY_RCODE].isNull() || !item[KEY_RCODE].isIntegral())
+                {
+                    ELOG("Batch RPC response item rcode is missing or not an integer");
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t size() const { return body_[KEY_RESULT].size(); }
+        RCode responseCode(size_t i) const { return static_cast<RCode>(body_[KEY_RESULT][(Json::ArrayIndex)i][KEY_RCODE].asInt()); }
+        Json::Value result(size_t i) const { return body_[KEY_RESULT][(Json::ArrayIndex)i][KEY_RESULT]; }
+        void addResult(RCode rcode, const Json::Value &result)
+        {
+            Json::Value item;
+            item[KEY_RCODE] = static_cast<int>(rcode);
+            item[KEY_RESULT] = result;
+            body_[KEY_RESULT].append(item);
+        }
+        using JsonResponse::responseCode;
+
+    private:
+    };
+
     class TopicResponse : public JsonResponse
     {
     public:
@@ -307,6 +535,12 @@ namespace zrcrpc
                 return std::make_shared<ServiceRequest>();
             case MType::RSP_SERVICE:
                 return std::make_shared<ServiceResponse>();
+            case MType::REQ_BATCH_RPC:
+                return std::make_shared<BatchRpcRequest>();
+            case MType::RSP_BATCH_RPC:
+                return std::make_shared<BatchRpcResponse>();
+            case MType::REQ_TOPIC_BATCH:
+                return std::make_shared<TopicBatchRequest>();
             }
             return BaseMessage::Ptr();
         }
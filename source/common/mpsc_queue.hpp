@@ -0,0 +1,72 @@
+/*
+    多生产者单消费者的无锁队列：任意线程都可以push，只有一个线程（连接所属的IO线程）调用popAll一次取走全部元素
+    1、push用CAS把节点挂到链表头，生产者之间只竞争一个原子指针，不需要加锁
+    2、popAll把整条链表一次交换出来再反转，得到的元素顺序和push的顺序一致（同一个生产者的元素保持先后顺序）
+    3、消费者每次取走全部元素，不存在单个节点出队时的ABA问题
+*/
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace zrcrpc
+{
+    template <typename T>
+    class MpscQueue
+    {
+    public:
+        MpscQueue() : _head(nullptr) {}
+        ~MpscQueue()
+        {
+            std::vector<T> rest;
+            popAll(rest);
+        }
+        MpscQueue(const MpscQueue &) = delete;
+        MpscQueue &operator=(const MpscQueue &) = delete;
+
+        void push(T &&val)
+        {
+            Node *node = new Node(std::move(val));
+            node->_next = _head.load(std::memory_order_relaxed);
+            while (!_head.compare_exchange_weak(node->_next, node))
+            {
+            }
+        }
+        // 取走全部元素，按照push的顺序追加到out的末尾，返回取到的个数
+        size_t popAll(std::vector<T> &out)
+        {
+            Node *node = _head.exchange(nullptr);
+            Node *prev = nullptr;
+            while (node) // 链表是后进先出的，先反转回push的顺序
+            {
+                Node *next = node->_next;
+                node->_next = prev;
+                prev = node;
+                node = next;
+            }
+            size_t count = 0;
+            while (prev)
+            {
+                Node *next = prev->_next;
+                out.push_back(std::move(prev->_val));
+                delete prev;
+                prev = next;
+                count++;
+            }
+            return count;
+        }
+        bool empty() const
+        {
+            return _head.load() == nullptr;
+        }
+
+    private:
+        struct Node
+        {
+            Node(T &&val) : _val(std::move(val)), _next(nullptr) {}
+            T _val;
+            Node *_next;
+        };
+        std::atomic<Node *> _head;
+    };
+}
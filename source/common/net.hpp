@@ -6,12 +6,16 @@
 
 #include "muduo/net/EventLoop.h"
 #include "muduo/net/EventLoopThread.h"
+#include "muduo/net/EventLoopThreadPool.h"
 #include "muduo/base/CountDownLatch.h"
 #include "detail.hpp"
 #include "fields.hpp"
 #include "abstract.hpp"
 #include "message.hpp"
+#include "mpsc_queue.hpp"
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <unordered_map>
 
 namespace zrcrpc
@@ -47,6 +51,14 @@ namespace zrcrpc
         {
             return _buff->retrieveAsString(length);
         }
+        virtual const char *peek() const override
+        {
+            return _buff->peek();
+        }
+        virtual void retrieve(size_t length) override
+        {
+            _buff->retrieve(length);
+        }
 
     private:
         muduo::net::Buffer *_buff;
@@ -68,7 +80,8 @@ namespace zrcrpc
     class LVProtocol : public BaseProtocol
     {
     public:
-        //|--package_len--|--MType--|--IdLen--|--Id--|--body--|
+        //|--package_len--|--Codec<<16 | MType--|--Id(8字节)--|--body--|
+        // MType字段的高16位用来表示body的编码方式，低16位才是真正的消息类型
         virtual ~LVProtocol() noexcept = default;
 
         // 判断缓冲区里面的数据长度是否满足一次报文的长度
@@ -86,7 +99,11 @@ namespace zrcrpc
             // DLOG("before peekint32");
             int32_t len = buffer->peekInt32();
             // DLOG("after peekInt32");
-            if (buffer->readableBytes() < len + _lenFieldsLength)
+            // 长度字段是负数或者连报头都放不下的时候，这个连接上的数据已经没法解析了，再等多少数据也不会完整
+            // 这里返回true，交给onMessage判断出错误，调用方收到错误以后关闭连接
+            if (len < (int32_t)(_mtypeFieldsLength + _idFieldsLength))
+                return true;
+            if (buffer->readableBytes() < (size_t)len + _lenFieldsLength)
                 return false;
 
             return true;
@@ -94,72 +111,113 @@ namespace zrcrpc
 
         // 这里的消息采用lv格式，即length--value
         // 第一个参数length表示后续的长度属于这个报文
-        //|--package_len--|--MType--|--IdLen--|--Id--|--body--|
+        //|--package_len--|--Codec<<16 | MType--|--Id(8字节)--|--body--|
 
-        //这个函数就相当于反序列化，将缓冲区数据拿出来，根据缓冲区数据构造一个message
+        // 这个函数就相当于反序列化，直接在缓冲区的可读区域上解析报文，解析完成以后再把这个报文从缓冲区里面删除
+        // 这样body就不需要先拷贝成字符串，再交给反序列化函数
         virtual bool onMessage(const BaseBuffer::Ptr &buffer, BaseMessage::Ptr &msg) override
         {
-
-            // 1、将网络里面的数据全部提取出来
-            int32_t packageLen = buffer->readInt32();
-            int32_t mtype = buffer->readInt32();
-            int32_t idLen = buffer->readInt32();
-            std::string id = buffer->retrieveAsString(idLen);
-            size_t bodyLen = packageLen - _mtypeFieldsLength - _idFieldsLength - id.size();
-            // 网络当中的数据变为字符串
-            std::string body = buffer->retrieveAsString(bodyLen);
+            // 1、在缓冲区上借用一段报文的视图，canProcess已经保证了长度字段合法的报文是完整的
+            // 长度字段不合法的时候后面的报头可能还没有收到，先检查长度再读取后面的字段
+            const char *data = buffer->peek();
+            int32_t packageLen = peekInt32(data);
+            if (packageLen < (int32_t)(_mtypeFieldsLength + _idFieldsLength))
+            {
+                ELOG("LVProtocol header is invalid.");
+                return false;
+            }
+            int32_t typeField = peekInt32(data + _lenFieldsLength);
+            int32_t mtype = typeField & _mtypeMask;
+            CodecType codec = (CodecType)(((uint32_t)typeField) >> _codecShift);
+            uint64_t id = peekUint64(data + _lenFieldsLength + _mtypeFieldsLength);
+            const char *body = data + _lenFieldsLength + _mtypeFieldsLength + _idFieldsLength;
+            size_t bodyLen = packageLen - _mtypeFieldsLength - _idFieldsLength;
 
             // 2、根据提取出来的数据创建消息类型,然后将数据写入到message里面
             msg = zrcrpc::MessageFactory::create((zrcrpc::MType)mtype);
             if (!msg)
             {
                 ELOG("Failed to create message.");
+                buffer->retrieve(_lenFieldsLength + packageLen);
                 return false;
             }
 
             // 3、根据缓冲区数据写入到创建消息的信息
-            // 反序列化
-            bool ret = msg->deserialize(body);
+            // 反序列化，直接解析缓冲区里面的body
+            bool ret = msg->deserialize(codec, body, bodyLen);
+            if (ret)
+            {
+                msg->setMessageType((zrcrpc::MType)mtype);
+                msg->setId(id);
+                msg->setCodec(codec);
+            }
+            // 4、解析完成以后才把这个报文从缓冲区里面删除，在这之前body指向的内存都是有效的
+            buffer->retrieve(_lenFieldsLength + packageLen);
             if (!ret)
             {
                 ELOG("LVProtocol parsing failed.");
                 return false;
             }
-            msg->setMessageType((zrcrpc::MType)mtype);
-            msg->setId(id);
-
             return true;
         }
         // 将数据里面的Json::Value类型_body拿出来，加上前缀字段，组成一个完整的报文
-        //|--package_len--|--MType--|--IdLen--|--Id--|--body--|
-        virtual std::string serialize(const BaseMessage::Ptr &message) const override
+        //|--package_len--|--Codec<<16 | MType--|--Id(8字节)--|--body--|
+        // 报头和body都直接写进同一个字符串里面：先预留好报头的位置，body序列化的时候直接追加在报头后面，
+        // 最后再把长度字段回填到报头里面，整个过程没有body的中间拷贝
+        virtual std::string serialize(const BaseMessage::Ptr &message, CodecType codec) const override
         {
-            std::string body = message->serialize();
-            MType mtype = (MType)htonl((uint32_t)message->messageType());
-            std::string id = message->id();
-            int32_t idLen = htonl(id.size());
-            int32_t h_totalLen = _mtypeFieldsLength + _idFieldsLength + id.size() + body.size();
-            int32_t totalLen = htonl(h_totalLen);
+            const size_t headerLen = _lenFieldsLength + _mtypeFieldsLength + _idFieldsLength;
+            std::string sendData;
+            sendData.reserve(headerLen + 256);
+            sendData.append(headerLen, '\0');
+            if (message->serialize(codec, sendData) == false)
+            {
+                ELOG("LVProtocol serialize failed.");
+                return std::string();
+            }
 
             // 这里to_string是错误的，假设totalLen是123
             // 理论上写入应该是二进制形式的四个字节07 00 00 00(这里使用16进制表示4个字节)
             // 实际上写入的"123"
             // 应该写入四个字节的数据的
-            std::string sendData;
-            sendData.reserve(h_totalLen);
-            sendData.append((char *)&totalLen, _lenFieldsLength);
-            sendData.append((char *)&mtype, _mtypeFieldsLength);
-            sendData.append((char *)&idLen, _idFieldsLength);
-
-            sendData += id + body;
-
+            int32_t totalLen = htonl(sendData.size() - _lenFieldsLength);
+            uint32_t mtype = htonl(((uint32_t)codec << _codecShift) | (uint32_t)message->messageType());
+            char *header = &sendData[0];
+            ::memcpy(header, &totalLen, _lenFieldsLength);
+            ::memcpy(header + _lenFieldsLength, &mtype, _mtypeFieldsLength);
+            writeUint64(header + _lenFieldsLength + _mtypeFieldsLength, message->id());
             return sendData;
         }
 
+    private:
+        // 从缓冲区的视图里面读取一个网络字节序的int32
+        static int32_t peekInt32(const char *data)
+        {
+            int32_t be32 = 0;
+            ::memcpy(&be32, data, sizeof be32);
+            return ntohl(be32);
+        }
+        // 64位的id按照高32位在前、低32位在后的网络字节序读写
+        static uint64_t peekUint64(const char *data)
+        {
+            uint64_t high = (uint32_t)peekInt32(data);
+            uint64_t low = (uint32_t)peekInt32(data + 4);
+            return (high << 32) | low;
+        }
+        static void writeUint64(char *data, uint64_t val)
+        {
+            uint32_t high = htonl((uint32_t)(val >> 32));
+            uint32_t low = htonl((uint32_t)val);
+            ::memcpy(data, &high, 4);
+            ::memcpy(data + 4, &low, 4);
+        }
+
     private:
         static const size_t _lenFieldsLength = 4;
         static const size_t _mtypeFieldsLength = 4;
-        static const size_t _idFieldsLength = 4;
+        static const size_t _idFieldsLength = 8;
+        static const int _codecShift = 16;
+        static const int32_t _mtypeMask = 0xffff;
     };
 
     class ProtocolFactory
@@ -181,35 +239,177 @@ namespace zrcrpc
 
     // 真正使用的时候，不需要创建多个MuduoConnection对象
     // 只需要传递进来参数就可以了
-    class MuduoConnection : public BaseConnection
+    class MuduoConnection : public BaseConnection, public std::enable_shared_from_this<MuduoConnection>
     {
     public:
+        /*
+            连接有三种状态：
+            1、CONNECTING：客户端发起了连接但是TCP连接还没有建立，这时候发送的报文先序列化好放在_pending里面
+            2、CONNECTED：TCP连接建立以后由attach切换到这个状态，同时把_pending里面的报文按顺序发出去
+            3、CLOSED：连接断开或者连接超时，之后发送的报文直接丢弃
+            _con只在attach的时候设置一次，之后不再修改，所以CONNECTED状态下发送报文不需要加锁
+
+            CONNECTED状态下的写合并：
+            任意线程发送的报文都先放进无锁的发送队列_outbox，队列从空变成非空的时候向IO线程投递一次flush
+            IO线程在这一轮事件循环的最后执行flush，把队列里面积攒的报文拼在一起，只调用一次TcpConnection::send
+            流水线的异步调用、主题的广播、一次读到的多个请求的响应，都会合并成一次写
+        */
         using Ptr = std::shared_ptr<MuduoConnection>;
         // 这里的connection要使用指针，不能只用TcpConnection，这个不需要拷贝
-        MuduoConnection(const muduo::net::TcpConnectionPtr &con, const BaseProtocol::Ptr &protocol)
+        // con为空的时候表示连接还没有建立，处于CONNECTING状态
+        MuduoConnection(const muduo::net::TcpConnectionPtr &con, const BaseProtocol::Ptr &protocol,
+                        CodecType codec = CodecType::JSON)
             : _con(con),
-              _protocol(protocol)
+              _protocol(protocol),
+              _codec((int)codec),
+              _state(con ? CONNECTED : CONNECTING),
+              _flush_queued(false)
         {
         }
         virtual ~MuduoConnection() noexcept = default;
         virtual void send(const BaseMessage::Ptr &message) override
         {
             // 这个是发送函数，，将传入的消息进行序列化后，再发送数据
-            std::string msg = _protocol->serialize(message);
-            _con->send(msg);
+            Frame msg = frame(message);
+            if (msg)
+                sendFrame(msg);
+        }
+        virtual Frame frame(const BaseMessage::Ptr &message) const override
+        {
+            std::string msg = _protocol->serialize(message, codec());
+            if (msg.empty())
+                return Frame();
+            return std::make_shared<const std::string>(std::move(msg));
+        }
+        // 报文本身不会被拷贝，发送队列里面放的只是报文的引用
+        virtual void sendFrame(const Frame &msg) override
+        {
+            if (_state.load(std::memory_order_acquire) != CONNECTED)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                int state = _state.load(std::memory_order_relaxed);
+                if (state == CONNECTING)
+                {
+                    _pending.push_back(msg);
+                    return;
+                }
+                if (state == CLOSED)
+                {
+                    ILOG("disconnected");
+                    return;
+                }
+            }
+            _outbox.push(Frame(msg));
+            // 已经有flush在排队的时候，这个报文会被那一次flush带走
+            if (_flush_queued.exchange(true) == false)
+            {
+                // 在IO线程里面调用的时候queueInLoop不会唤醒事件循环，flush在这一轮处理完所有事件以后执行
+                _con->getLoop()->queueInLoop(std::bind(&MuduoConnection::flush, shared_from_this()));
+            }
+        }
+        virtual void runAfter(double delay, const std::function<void()> &task) override
+        {
+            // 还没有建立连接的时候没有IO线程，直接执行
+            if (_state.load(std::memory_order_acquire) == CONNECTING || !_con)
+            {
+                task();
+                return;
+            }
+            _con->getLoop()->runAfter(delay, task);
         }
         virtual void shutdown() override
         {
-            _con->shutdown();
+            if (_state.load(std::memory_order_acquire) == CONNECTED)
+                _con->shutdown();
+            else
+                close();
+        }
+        virtual void forceClose() override
+        {
+            if (_state.load(std::memory_order_acquire) == CONNECTED)
+                _con->forceClose();
+            else
+                close();
         }
         virtual bool isConnected() const override
         {
-            return _con->connected();
+            return _state.load(std::memory_order_acquire) == CONNECTED && _con->connected();
+        }
+        virtual bool isClosed() const override
+        {
+            return _state.load(std::memory_order_acquire) == CLOSED;
+        }
+        virtual CodecType codec() const override
+        {
+            return (CodecType)_codec.load(std::memory_order_relaxed);
+        }
+        virtual void setCodec(CodecType codec) override
+        {
+            _codec.store((int)codec, std::memory_order_relaxed);
+        }
+
+        // TCP连接建立以后在IO线程里面调用，先把连接期间积攒的报文发出去，再切换到CONNECTED状态
+        // 这之后其他线程发送的报文都会投递到IO线程，排在这些报文的后面，顺序不会乱
+        bool attach(const muduo::net::TcpConnectionPtr &con)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_state.load(std::memory_order_relaxed) != CONNECTING)
+                return false; // 已经超时关闭了
+            _con = con;
+            for (auto &msg : _pending)
+                _con->send(*msg);
+            _pending.clear();
+            _state.store(CONNECTED, std::memory_order_release);
+            return true;
+        }
+        // 标记连接关闭，丢掉还没有发出去的报文
+        // 返回false表示之前已经关闭过，关闭通知只需要发一次
+        bool close()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_state.exchange(CLOSED, std::memory_order_acq_rel) == CLOSED)
+                return false;
+            _pending.clear();
+            return true;
+        }
+
+    private:
+        // 在IO线程里面执行，把发送队列里面的报文一次写出去
+        void flush()
+        {
+            // 先清掉标记再取报文：取完以后才放进来的报文会重新投递一次flush，不会留在队列里面
+            _flush_queued.store(false);
+            std::vector<Frame> msgs;
+            if (_outbox.popAll(msgs) == 0)
+                return;
+            if (msgs.size() == 1)
+            {
+                // 只有一个报文的时候直接写socket，写不完的部分才会拷贝到muduo的输出缓冲区
+                _con->send(*msgs[0]);
+                return;
+            }
+            // 多个报文拼到一个缓冲区里面，只写一次socket；缓冲区只在IO线程里面使用，send以后会被清空，下一次flush接着复用
+            for (auto &msg : msgs)
+                _flush_buf.append(*msg);
+            _con->send(&_flush_buf);
         }
 
     private:
+        enum
+        {
+            CONNECTING = 0,
+            CONNECTED,
+            CLOSED
+        };
         muduo::net::TcpConnectionPtr _con;
         BaseProtocol::Ptr _protocol;
+        std::atomic<int> _codec; // 发送时使用的编码方式，服务端会跟随客户端发来的报文的编码方式
+        std::atomic<int> _state;
+        std::mutex _mutex;                 // 保护_pending以及状态的切换
+        std::vector<Frame> _pending;       // 连接建立之前发送的报文
+        MpscQueue<Frame> _outbox;          // 连接建立以后等待IO线程写出去的报文
+        std::atomic<bool> _flush_queued;   // 是否已经向IO线程投递了flush
+        muduo::net::Buffer _flush_buf;     // flush拼接报文用的缓冲区，只在IO线程里面使用
     };
 
     class ConnectionFactory
@@ -242,6 +442,17 @@ namespace zrcrpc
         {
         }
 
+        // 多Reactor模式：主循环_loop只负责accept，新连接按照轮询的方式分配给num个IO线程的EventLoop
+        virtual void setThreadNum(int num) override
+        {
+            if (num < 0)
+            {
+                ELOG("IO线程数量不能为负数");
+                return;
+            }
+            _server.setThreadNum(num);
+        }
+
         virtual void start() override
         {
             // 先设置回调函数到muduo库的回调函数当中
@@ -277,6 +488,16 @@ namespace zrcrpc
                     }
                     _cons[conn] = muduoConn;
                 }
+                // 多个IO线程下_cons会被并发访问，这里把BaseConnection挂到muduo连接的context上
+                // 之后onMessage在连接所属的IO线程里面直接取出来，不需要每条消息都去加锁查哈希
+                conn->setContext(muduoConn);
+                if (congestion_callback_)
+                {
+                    // 对端读得太慢，输出缓冲区越过高水位的时候标记拥塞，缓冲区写空以后解除
+                    conn->setHighWaterMarkCallback(std::bind(&MuduoServer::onHighWaterMark, this, std::placeholders::_1, std::placeholders::_2),
+                                                   high_water_mark_);
+                    conn->setWriteCompleteCallback(std::bind(&MuduoServer::onWriteComplete, this, std::placeholders::_1));
+                }
                 if (connection_callback_)
                     connection_callback_(muduoConn);
             }
@@ -294,17 +515,39 @@ namespace zrcrpc
                     muduoConn = _cons[conn];
                     _cons.erase(conn);
                 }
+                conn->setContext(boost::any());
                 if (close_callback_)
                     close_callback_(muduoConn);
             }
         }
 
+        void onHighWaterMark(const muduo::net::TcpConnectionPtr &conn, size_t)
+        {
+            const BaseConnection::Ptr *pconn = boost::any_cast<BaseConnection::Ptr>(&conn->getContext());
+            if (pconn && *pconn && (*pconn)->setCongested(true))
+                congestion_callback_(*pconn, true);
+        }
+        // 每次输出缓冲区写空都会调用，只有之前标记过拥塞的连接才需要通知
+        void onWriteComplete(const muduo::net::TcpConnectionPtr &conn)
+        {
+            const BaseConnection::Ptr *pconn = boost::any_cast<BaseConnection::Ptr>(&conn->getContext());
+            if (pconn && *pconn && (*pconn)->congested() && (*pconn)->setCongested(false))
+                congestion_callback_(*pconn, false);
+        }
+
         // 这个函数是创建消息的回调函数,给muduo库使用的，就是用来创建消息
         // muduo库实现的是将从网络里面接收消息到缓冲区，这里的回调函数就是缓冲区进行处理
         void onMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buff, muduo::Timestamp)
         {
             BaseBuffer::Ptr muduoBuff = BufferFactory::create(buff);
-            BaseConnection::Ptr muduoConn;
+            // 根据muduo库的连接找到自己的BaseConnnection连接，context只会在连接所属的IO线程里面被修改
+            const BaseConnection::Ptr *pconn = boost::any_cast<BaseConnection::Ptr>(&conn->getContext());
+            if (pconn == nullptr || !(*pconn))
+            {
+                ELOG("conn not exist");
+                return;
+            }
+            BaseConnection::Ptr muduoConn = *pconn;
             while (1)
             {
 
@@ -332,14 +575,9 @@ namespace zrcrpc
                     ELOG("This data is err in the buffer");
                     return;
                 }
-                // 3、根据muduo库的连接查哈希映射找到自己的BaseConnnection连接
-
-                if (_cons.find(conn) == _cons.end())
-                {
-                    ELOG("conn not exist");
-                    return;
-                }
-                muduoConn = _cons[conn];
+                // 3、服务端的编码方式跟随客户端，客户端用什么格式发送请求，响应就用什么格式
+                if (muduoMsg->codec() != muduoConn->codec())
+                    muduoConn->setCodec(muduoMsg->codec());
                 // 上面从缓冲区提取出来数据，但是不添加报文信息
                 // 下面继续调用用户传入的回调函数然后进行报头的处理
                 if (message_callback_)
@@ -348,11 +586,12 @@ namespace zrcrpc
         }
 
     private:
-        muduo::net::TcpServer _server;
+        // _loop必须在_server之前构造，_server的构造函数需要使用_loop
         muduo::net::EventLoop _loop;
+        muduo::net::TcpServer _server;
         BaseProtocol::Ptr _protocol; // 创建自己的BaseConnection时候需要用到这个，要在构造函数里面初始化
         std::mutex _mutex;
-        std::unordered_map<muduo::net::TcpConnectionPtr, BaseConnection::Ptr> _cons; // 这里的_con属于共享资源，可能被并发访问所以要加锁
+        std::unordered_map<muduo::net::TcpConnectionPtr, BaseConnection::Ptr> _cons; // 这里的_con属于共享资源，多个IO线程会并发访问所以要加锁
         static const size_t MaxSize = (1 << 16);
     };
 
@@ -368,6 +607,66 @@ namespace zrcrpc
     private:
     };
 
+    //////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /*                ClientRuntime类，进程里面所有客户端连接共用的一组IO线程
+            1、原来每个MuduoClient都会启动一个自己的EventLoopThread，连接多少个服务提供者就有多少个IO线程
+            2、现在所有的MuduoClient都从这里按照轮询的方式取一个事件循环，线程数量是固定的
+            3、线程数量通过setThreadNum设置，必须在创建第一个客户端之前调用，默认和CPU核数相同
+            4、对象创建以后一直存在到进程退出，不会析构，避免进程退出的时候还有客户端在使用事件循环
+    */
+    class ClientRuntime
+    {
+    public:
+        static ClientRuntime &instance()
+        {
+            static ClientRuntime *runtime = new ClientRuntime(threadNum().load());
+            return *runtime;
+        }
+        static void setThreadNum(int num)
+        {
+            threadNum().store(num);
+        }
+
+        // 轮询选择一个事件循环，可以在任意线程调用
+        // EventLoopThreadPool::getNextLoop要求在主循环线程里面调用，所以这里使用启动时缓存下来的事件循环列表
+        muduo::net::EventLoop *getNextLoop()
+        {
+            return _loops[_next.fetch_add(1, std::memory_order_relaxed) % _loops.size()];
+        }
+        size_t loopNum() const { return _loops.size(); }
+
+    private:
+        ClientRuntime(int num)
+            : _next(0),
+              _baseLoop(_baseThread.startLoop()),
+              _pool(_baseLoop, "ClientRuntime")
+        {
+            if (num <= 0)
+                num = std::max(1, (int)std::thread::hardware_concurrency());
+            _pool.setThreadNum(num);
+            // 线程池的start和getAllLoops都只能在主循环所在的线程里面调用
+            muduo::CountDownLatch latch(1);
+            _baseLoop->runInLoop([this, &latch]()
+                                 {
+                                     _pool.start();
+                                     _loops = _pool.getAllLoops();
+                                     latch.countDown(); });
+            latch.wait();
+        }
+        static std::atomic<int> &threadNum()
+        {
+            static std::atomic<int> num(0);
+            return num;
+        }
+
+    private:
+        std::atomic<size_t> _next;
+        muduo::net::EventLoopThread _baseThread; // 线程池的主循环，只用来启动线程池
+        muduo::net::EventLoop *_baseLoop;
+        muduo::net::EventLoopThreadPool _pool;
+        std::vector<muduo::net::EventLoop *> _loops; // 启动以后就不再修改
+    };
+
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /*                BaseClient类，
      */
@@ -375,32 +674,78 @@ namespace zrcrpc
     {
     public:
         using Ptr = std::shared_ptr<MuduoClient>;
-        MuduoClient(std::string ip, int port) // 忘记初始化_protocol
-            : _protocol(ProtocolFactory::create()),
+        MuduoClient(std::string ip, int port, CodecType codec = CodecType::JSON) // 忘记初始化_protocol
+            : _codec(codec),
+              _protocol(ProtocolFactory::create()),
               _cntlatch(1),
-              _loop(_loopThread.startLoop()),
-              _client(_loop, muduo::net::InetAddress(ip, port), "MuduoClient")
+              _loop(ClientRuntime::instance().getNextLoop()),
+              _client(_loop, muduo::net::InetAddress(ip, port), "MuduoClient"),
+              _started(false),
+              _detached(false)
+        {
+            // 连接对象在发起连接之前就创建好，一直到客户端析构都不会更换，连接建立之前发送的消息在里面排队
+            _conn = std::make_shared<MuduoConnection>(muduo::net::TcpConnectionPtr(), _protocol, _codec);
+            _client.setMessageCallback(std::bind(&MuduoClient::OnMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+            _client.setConnectionCallback(std::bind(&MuduoClient::OnConnection, this, std::placeholders::_1));
+        }
+        // 事件循环是共用的，客户端析构以后循环还会继续运行
+        // 析构总是在自己的事件循环线程里面执行(见release)，取消定时任务、断开连接上指向自己的回调，之后事件循环就不会再调用到这个对象
+        virtual ~MuduoClient()
+        {
+            runInLoopAndWait([this]()
+                             {
+                                 for (auto &timer : _timers)
+                                     _loop->cancel(timer);
+                                 _client.stop();
+                                 closeConnection();
+                                 muduo::net::TcpConnectionPtr conn = _client.connection();
+                                 if (conn)
+                                 {
+                                     // 连接对象可能还被上层持有，这里直接关闭TCP连接，关闭以后由事件循环自己回收，不再通知TcpClient
+                                     muduo::net::EventLoop *loop = _loop;
+                                     conn->setMessageCallback(muduo::net::defaultMessageCallback);
+                                     conn->setConnectionCallback(muduo::net::defaultConnectionCallback);
+                                     conn->setCloseCallback([loop](const muduo::net::TcpConnectionPtr &c)
+                                                            { loop->queueInLoop(std::bind(&muduo::net::TcpConnection::connectDestroyed, c)); });
+                                     conn->forceClose();
+                                 } });
+        }
 
+        // ClientFactory创建的客户端的删除器：最后一个引用可能在任意线程(包括别的客户端的事件循环线程)里面释放，
+        // 跨线程阻塞等待另一个事件循环可能互相卡死，所以这里只同步地和上层断开，真正的析构投递到自己的事件循环里面异步执行
+        static void release(MuduoClient *client)
         {
+            client->detach();
+            muduo::net::EventLoop *loop = client->_loop;
+            loop->queueInLoop([client]()
+                              { delete client; });
         }
-        virtual ~MuduoClient() = default;
 
         virtual void connect() override
         {
-            _client.setMessageCallback(std::bind(&MuduoClient::OnMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-            _client.setConnectionCallback(std::bind(&MuduoClient::OnConnection, this, std::placeholders::_1));
-            _client.connect(); // 由于非阻塞的原因,这里使用该函数的时候，必须使用条件变量去等待
-            _cntlatch.wait();
+            connectAsync(0);
+            if (_loop->isInLoopThread())
+            {
+                // 在共用的事件循环线程里面等待会把自己卡死，这里只发起连接，消息会在连接建立以后再发送
+                ELOG("不能在事件循环线程里面阻塞等待连接建立");
+                return;
+            }
+            _cntlatch.wait(); // 由于非阻塞的原因,这里使用该函数的时候，必须使用条件变量去等待
             DLOG("connect completed");
         }
-        virtual void send(const BaseMessage::Ptr &message) override
+        virtual void connectAsync(int timeout_ms) override
         {
-            bool ret = isConnected();
-            if (ret == false)
-            {
-                ILOG("disconnected");
+            if (_started.exchange(true))
                 return;
+            _client.connect();
+            if (timeout_ms > 0)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _timers.push_back(_loop->runAfter(timeout_ms / 1000.0, std::bind(&MuduoClient::onConnectTimeout, this)));
             }
+        }
+        virtual void send(const BaseMessage::Ptr &message) override
+        {
             _conn->send(message);
         }
         virtual void shutdown() override
@@ -410,7 +755,7 @@ namespace zrcrpc
         }
         virtual bool isConnected() const override
         {
-            return _conn && _conn->isConnected();
+            return _conn->isConnected();
         }
 
         virtual BaseConnection::Ptr connection() const override // 返回_conn连接
@@ -421,23 +766,81 @@ namespace zrcrpc
             //     return ConnectionFactory::create(_conn, ProtocolFactory::create());
             // }
         }
+        virtual void runEvery(double interval, const TimerCallback &task) override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _timers.push_back(_loop->runEvery(interval, task));
+        }
 
     private:
+        // 和上层断开：定时任务取消(取消操作排在析构之前执行)，还在这个连接上等待响应的请求马上结束，之后不再回调上层
+        void detach()
+        {
+            _detached.store(true);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (auto &timer : _timers)
+                    _loop->cancel(timer);
+                _timers.clear();
+            }
+            closeConnection();
+        }
+
+        void runInLoopAndWait(const std::function<void()> &task)
+        {
+            if (_loop->isInLoopThread())
+            {
+                task();
+                return;
+            }
+            muduo::CountDownLatch latch(1);
+            _loop->runInLoop([&task, &latch]()
+                             {
+                                 task();
+                                 latch.countDown(); });
+            latch.wait();
+        }
+
         void OnConnection(const muduo::net::TcpConnectionPtr &conn) // 连接的时候使用的
         {
             if (conn->connected()) // 连接成功
             {
-
+                if (_conn->attach(conn) == false)
+                {
+                    // 连接超时已经放弃了，晚到的连接直接关掉
+                    conn->shutdown();
+                    return;
+                }
                 _cntlatch.countDown(); // 计数器--，唤醒条件变量
-                _conn = ConnectionFactory::create(conn, _protocol);
+                if (connection_callback_ && !_detached.load())
+                    connection_callback_(_conn);
             }
             else // 连接断开
             {
                 DLOG("连接断开");
-                _conn.reset();
+                closeConnection();
             }
         }
 
+        // 连接超时：不再重试连接，把连接标记为关闭，通知上层把挂在这个连接上的请求结束掉
+        void onConnectTimeout()
+        {
+            if (_conn->isConnected() || _conn->isClosed())
+                return;
+            ELOG("连接超时");
+            _client.stop();
+            closeConnection();
+        }
+
+        void closeConnection()
+        {
+            // 析构线程和事件循环线程可能同时走到这里，只有真正把连接关掉的那一次通知上层
+            if (_conn->close() == false)
+                return;
+            if (close_callback_)
+                close_callback_(_conn);
+        }
+
         void OnMessage(const muduo::net::TcpConnectionPtr &conn, muduo::net::Buffer *buff, muduo::Timestamp)
         {
             BaseBuffer::Ptr muduoBuff = BufferFactory::create(buff);
@@ -468,7 +871,7 @@ namespace zrcrpc
                     return;
                 }
 
-                if (message_callback_)
+                if (message_callback_ && !_detached.load())
                 {
                     // DLOG("调用回调函数");
                     message_callback_(_conn, muduoMsg);
@@ -477,13 +880,17 @@ namespace zrcrpc
         }
 
     private:
-        // 这里注意成员变量的顺序和初始化之间的顺序不能乱，要先初始化loopthread,再loop，在使用loop去初始化client
-        BaseConnection::Ptr _conn;
+        // 这里注意成员变量的顺序和初始化之间的顺序不能乱，要先拿到loop，再使用loop去初始化client
+        MuduoConnection::Ptr _conn;
+        CodecType _codec; // 这个客户端的连接发送消息使用的编码方式
         BaseProtocol::Ptr _protocol;
         muduo::CountDownLatch _cntlatch;
-        muduo::net::EventLoopThread _loopThread;
-        muduo::net::EventLoop *_loop;
+        muduo::net::EventLoop *_loop; // 从ClientRuntime里面分配的事件循环，多个客户端共用
         muduo::net::TcpClient _client;
+        std::mutex _mutex;                             // 保护_timers
+        std::vector<muduo::net::TimerId> _timers; // 挂在共用事件循环上的定时任务，析构的时候要取消
+        std::atomic<bool> _started;               // 只发起一次连接
+        std::atomic<bool> _detached;              // 已经和上层断开，事件循环里面的回调不再通知上层
 
         // BaseProtocol::Ptr _protocol; // 创建自己的BaseConnection时候需要用到这个，要在构造函数里面初始化
         // std::mutex _mutex;
@@ -493,10 +900,11 @@ namespace zrcrpc
     class ClientFactory
     {
     public:
+        // 客户端的析构要放到它自己的事件循环线程里面异步执行，所以这里不用make_shared，带上自己的删除器
         template <typename... Args>
         static MuduoClient::Ptr create(Args... args)
         {
-            return std::make_shared<MuduoClient>(std::forward<Args>(args)...);
+            return MuduoClient::Ptr(new MuduoClient(std::forward<Args>(args)...), &MuduoClient::release);
         }
 
     private:
@@ -0,0 +1,101 @@
+/*
+    哈希时间轮：用来处理大量的请求超时
+    1、时间轮上有_slotNum个槽，每个槽代表_tickMs毫秒，指针每走一格就处理一个槽
+    2、添加定时任务的时候根据超时时间算出落在哪个槽，超过一圈的任务记录还要再转几圈
+    3、添加任务是O(1)，每次tick只处理当前槽里面的任务，不需要像堆那样对所有任务排序
+    4、时间轮本身不带线程，由外部的事件循环定期调用tick来推动指针
+*/
+#pragma once
+#include "detail.hpp"
+#include <mutex>
+#include <vector>
+#include <functional>
+
+namespace zrcrpc
+{
+    class TimerWheel
+    {
+    public:
+        using Ptr = std::shared_ptr<TimerWheel>;
+        using Task = std::function<void()>;
+
+        TimerWheel(int tick_ms = 10, int slot_num = 512)
+            : _tickMs(tick_ms > 0 ? tick_ms : 1),
+              _slotNum(slot_num > 0 ? slot_num : 1),
+              _cursor(0),
+              _slots(_slotNum),
+              _last(std::chrono::steady_clock::now())
+        {
+        }
+
+        // 添加一个timeout_ms毫秒以后执行的任务，可以在任意线程调用
+        // 任务不支持取消：任务里面自己判断要处理的对象是否还存在，已经不存在就什么都不做
+        void add(int timeout_ms, const Task &task)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            // 指针停在_last对应的格子上，可能已经落后当前时间一段，落后的部分也要算进去
+            // 指针走到_cursor+ticks的时间是_last+ticks*_tickMs，向上取整，保证任务不会在超时之前被触发
+            int64_t lag = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _last).count();
+            int64_t total = lag + (timeout_ms > 0 ? timeout_ms : 0);
+            uint64_t ticks = (total + _tickMs - 1) / _tickMs;
+            if (ticks == 0)
+                ticks = 1;
+            size_t slot = (_cursor + ticks) % _slotNum;
+            _slots[slot].push_back(Timer{(ticks - 1) / _slotNum, task});
+        }
+
+        // 由事件循环定期调用，按照实际经过的时间推动指针
+        // 事件循环被阻塞的时候，下一次tick会把落下的格子一次补上
+        void tick()
+        {
+            std::vector<Task> expired;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto now = std::chrono::steady_clock::now();
+                int64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - _last).count();
+                int64_t steps = elapsed / _tickMs;
+                _last += std::chrono::milliseconds(steps * _tickMs);
+                for (int64_t i = 0; i < steps; i++)
+                {
+                    _cursor = (_cursor + 1) % _slotNum;
+                    std::vector<Timer> &timers = _slots[_cursor];
+                    size_t keep = 0;
+                    for (size_t j = 0; j < timers.size(); j++)
+                    {
+                        if (timers[j]._rounds == 0)
+                        {
+                            expired.push_back(std::move(timers[j]._task));
+                            continue;
+                        }
+                        timers[j]._rounds--;
+                        if (keep != j)
+                            timers[keep] = std::move(timers[j]);
+                        keep++;
+                    }
+                    timers.resize(keep);
+                }
+            }
+            // 任务在锁外面执行，任务里面可以再次添加定时任务
+            for (auto &task : expired)
+            {
+                task();
+            }
+        }
+        int tickMs() const { return _tickMs; }
+
+    private:
+        struct Timer
+        {
+            uint64_t _rounds; // 还需要再转几圈才到期
+            Task _task;
+        };
+
+    private:
+        const int _tickMs;
+        const size_t _slotNum;
+        size_t _cursor; // 当前指针所在的槽
+        std::vector<std::vector<Timer>> _slots;
+        std::chrono::steady_clock::time_point _last; // 上一次推进指针对应的时间
+        std::mutex _mutex;
+    };
+}
@@ -0,0 +1,186 @@
+/*
+    主题的通配符匹配：主题名字按照'.'分成多个段，比如md.eq.AAPL分成md、eq、AAPL三段
+    1、订阅的时候可以使用通配符：'*'匹配正好一段，'#'匹配零段或者多段，比如md.eq.*、md.#
+    2、所有的通配订阅放在一棵按段组织的字典树里面，匹配一个主题的代价只和主题的段数有关，和通配订阅的数量无关
+    3、字典树使用写时复制：修改的时候只复制从根到被修改节点这一条路径，再原子地替换根节点
+       匹配的时候原子地读取当前的根节点，不加锁，发布消息不会被订阅和取消订阅阻塞
+*/
+#pragma once
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+namespace zrcrpc
+{
+    template <typename T>
+    class TopicTrie
+    {
+    public:
+        using Ptr = std::shared_ptr<TopicTrie>;
+
+        TopicTrie() : _root(std::make_shared<const Node>()) {}
+
+        // 主题名字里面有一段是'*'或者'#'就是通配订阅
+        static bool isPattern(const std::string &key)
+        {
+            for (const auto &seg : split(key))
+            {
+                if (seg == SingleWildcard || seg == MultiWildcard)
+                    return true;
+            }
+            return false;
+        }
+        static std::vector<std::string> split(const std::string &key)
+        {
+            std::vector<std::string> segs;
+            size_t begin = 0;
+            while (true)
+            {
+                size_t pos = key.find(Separator, begin);
+                if (pos == std::string::npos)
+                {
+                    segs.emplace_back(key, begin);
+                    return segs;
+                }
+                segs.emplace_back(key, begin, pos - begin);
+                begin = pos + 1;
+            }
+        }
+
+        // 同一个通配订阅上重复添加同一个值会失败
+        bool insert(const std::string &pattern, const T &val)
+        {
+            std::vector<std::string> segs = split(pattern);
+            std::unique_lock<std::mutex> lock(_mutex);
+            bool added = false;
+            NodePtr root = insertAt(_root, segs, 0, val, added);
+            if (added)
+                std::atomic_store(&_root, root);
+            return added;
+        }
+        bool remove(const std::string &pattern, const T &val)
+        {
+            std::vector<std::string> segs = split(pattern);
+            std::unique_lock<std::mutex> lock(_mutex);
+            bool removed = false;
+            NodePtr root = removeAt(_root, segs, 0, val, removed);
+            if (!removed)
+                return false;
+            std::atomic_store(&_root, root ? root : std::make_shared<const Node>());
+            return true;
+        }
+        // 找到所有能匹配key的通配订阅上的值，追加到out里面
+        // 一个值挂在多个能匹配的通配订阅上(比如a.*和a.#)，或者'#'从不同的位置走到同一个节点的时候会被找到多次，追加的部分去重以后每个值只出现一次
+        void match(const std::string &key, std::vector<T> &out) const
+        {
+            NodePtr root = std::atomic_load(&_root);
+            if (root->_children.empty())
+                return;
+            size_t begin = out.size();
+            matchAt(root.get(), split(key), 0, out);
+            std::sort(out.begin() + begin, out.end());
+            out.erase(std::unique(out.begin() + begin, out.end()), out.end());
+        }
+        bool empty() const
+        {
+            return std::atomic_load(&_root)->_children.empty();
+        }
+
+    private:
+        struct Node;
+        using NodePtr = std::shared_ptr<const Node>;
+        struct Node
+        {
+            std::unordered_map<std::string, NodePtr> _children; // 下一段 -- 子节点，通配符也是普通的一段
+            std::vector<T> _values;                             // 在这个节点结束的通配订阅上挂的值
+        };
+
+        // 返回复制以后的新节点，node为空的时候新建节点
+        static NodePtr insertAt(const NodePtr &node, const std::vector<std::string> &segs, size_t i, const T &val, bool &added)
+        {
+            auto copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+            if (i == segs.size())
+            {
+                if (std::find(copy->_values.begin(), copy->_values.end(), val) == copy->_values.end())
+                {
+                    copy->_values.push_back(val);
+                    added = true;
+                }
+                return copy;
+            }
+            auto it = copy->_children.find(segs[i]);
+            copy->_children[segs[i]] = insertAt(it == copy->_children.end() ? NodePtr() : it->second, segs, i + 1, val, added);
+            return copy;
+        }
+        // 返回删除以后的新节点，节点上既没有值也没有子节点的时候返回空，父节点把它去掉
+        static NodePtr removeAt(const NodePtr &node, const std::vector<std::string> &segs, size_t i, const T &val, bool &removed)
+        {
+            auto copy = std::make_shared<Node>(*node);
+            if (i == segs.size())
+            {
+                auto it = std::find(copy->_values.begin(), copy->_values.end(), val);
+                if (it == copy->_values.end())
+                    return node;
+                copy->_values.erase(it);
+                removed = true;
+            }
+            else
+            {
+                auto it = copy->_children.find(segs[i]);
+                if (it == copy->_children.end())
+                    return node;
+                NodePtr child = removeAt(it->second, segs, i + 1, val, removed);
+                if (!removed)
+                    return node;
+                if (child)
+                    it->second = child;
+                else
+                    copy->_children.erase(it);
+            }
+            if (copy->_values.empty() && copy->_children.empty())
+                return NodePtr();
+            return copy;
+        }
+        static void matchAt(const Node *node, const std::vector<std::string> &segs, size_t i, std::vector<T> &out)
+        {
+            if (i == segs.size())
+            {
+                out.insert(out.end(), node->_values.begin(), node->_values.end());
+            }
+            else
+            {
+                auto it = node->_children.find(segs[i]);
+                if (it != node->_children.end())
+                    matchAt(it->second.get(), segs, i + 1, out);
+                // 发布的主题里面这一段本身就是'*'的时候，上面已经走过'*'子节点了
+                it = node->_children.find(SingleWildcard);
+                if (it != node->_children.end() && segs[i] != SingleWildcard)
+                    matchAt(it->second.get(), segs, i + 1, out);
+            }
+            // '#'吃掉剩下的零段、一段……直到全部段
+            auto it = node->_children.find(MultiWildcard);
+            if (it != node->_children.end())
+            {
+                for (size_t j = i; j <= segs.size(); j++)
+                    matchAt(it->second.get(), segs, j, out);
+            }
+        }
+
+    private:
+        static constexpr char Separator = '.';
+        static constexpr const char *SingleWildcard = "*";
+        static constexpr const char *MultiWildcard = "#";
+        std::mutex _mutex; // 只保护修改，多个修改之间不能互相覆盖
+        NodePtr _root;
+    };
+
+    template <typename T>
+    constexpr char TopicTrie<T>::Separator;
+    template <typename T>
+    constexpr const char *TopicTrie<T>::SingleWildcard;
+    template <typename T>
+    constexpr const char *TopicTrie<T>::MultiWildcard;
+}
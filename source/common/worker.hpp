@@ -0,0 +1,143 @@
+/*
+    业务线程池：把耗时的业务处理从muduo的IO线程里面拿出来
+    1、不要求有序的时候，所有工作线程共用一个任务队列，哪个线程空闲就由哪个线程处理
+    2、要求有序的时候，每个工作线程一个任务队列，同一个key（比如同一个连接）的任务总是投递到同一个队列，保证先进先出
+*/
+#pragma once
+#include "detail.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+
+namespace zrcrpc
+{
+    class WorkerPool
+    {
+    public:
+        using Ptr = std::shared_ptr<WorkerPool>;
+        using Task = std::function<void()>;
+
+        WorkerPool(int thread_num, bool ordered = false)
+            : _ordered(ordered), _next(0)
+        {
+            if (thread_num <= 0)
+                thread_num = 1;
+            // 有序模式下每个线程一个队列，无序模式下所有线程共用一个队列
+            int queue_num = _ordered ? thread_num : 1;
+            for (int i = 0; i < queue_num; i++)
+            {
+                _queues.emplace_back(new TaskQueue());
+            }
+            for (int i = 0; i < thread_num; i++)
+            {
+                TaskQueue *queue = _queues[_ordered ? i : 0].get();
+                _threads.emplace_back(&WorkerPool::run, this, queue);
+            }
+        }
+        ~WorkerPool()
+        {
+            stop();
+        }
+
+        // 不关心顺序的任务，无序模式下直接进入共享队列，有序模式下轮询分配
+        void post(const Task &task)
+        {
+            push(_queues[_next.fetch_add(1) % _queues.size()].get(), task);
+        }
+        // 同一个key的任务在有序模式下总是由同一个线程按照投递顺序执行
+        // key经常是对象地址的哈希(libstdc++里面就是地址本身)，低位都是对齐的0，先把高位打散再取模，否则所有的key都落在同一个队列上
+        void post(size_t key, const Task &task)
+        {
+            push(_queues[mix(key) % _queues.size()].get(), task);
+        }
+        bool ordered() const { return _ordered; }
+
+        // 停止线程池，队列里面剩下的任务会被执行完再退出
+        void stop()
+        {
+            for (auto &queue : _queues)
+            {
+                std::unique_lock<std::mutex> lock(queue->_mutex);
+                queue->_stop = true;
+                queue->_cond.notify_all();
+            }
+            for (auto &th : _threads)
+            {
+                if (th.joinable())
+                    th.join();
+            }
+        }
+
+    private:
+        // splitmix64的最后一步
+        static uint64_t mix(uint64_t x)
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ULL;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebULL;
+            x ^= x >> 31;
+            return x;
+        }
+        struct TaskQueue
+        {
+            std::mutex _mutex;
+            std::condition_variable _cond;
+            std::deque<Task> _tasks;
+            bool _stop = false;
+        };
+
+        void push(TaskQueue *queue, const Task &task)
+        {
+            {
+                std::unique_lock<std::mutex> lock(queue->_mutex);
+                if (queue->_stop)
+                {
+                    ELOG("线程池已经停止，任务被丢弃");
+                    return;
+                }
+                queue->_tasks.push_back(task);
+            }
+            queue->_cond.notify_one();
+        }
+
+        void run(TaskQueue *queue)
+        {
+            while (true)
+            {
+                Task task;
+                {
+                    std::unique_lock<std::mutex> lock(queue->_mutex);
+                    queue->_cond.wait(lock, [queue]()
+                                      { return queue->_stop || !queue->_tasks.empty(); });
+                    if (queue->_tasks.empty()) // 只有stop并且任务处理完才会走到这里
+                        return;
+                    task = std::move(queue->_tasks.front());
+                    queue->_tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+    private:
+        bool _ordered;
+        std::atomic<size_t> _next;
+        std::vector<std::unique_ptr<TaskQueue>> _queues;
+        std::vector<std::thread> _threads;
+    };
+
+    class WorkerPoolFactory
+    {
+    public:
+        template <typename... Args>
+        static WorkerPool::Ptr create(Args &&...args)
+        {
+            return std::make_shared<WorkerPool>(std::forward<Args>(args)...);
+        }
+
+    private:
+    };
+}
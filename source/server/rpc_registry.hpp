@@ -158,7 +158,7 @@ namespace zrcrpc
             {
                 Discoverer::Ptr discoverer;
                 {
-                    std::unique_lock<std::mutex> lock();
+                    std::unique_lock<std::mutex> lock(_mutex);
                     auto it = _conns.find(c);
                     if (it != _conns.end()) // 存在该连接的发现者，直接返回对应的发现者
                     {
@@ -1,6 +1,7 @@
 #pragma once
 #include "../common/net.hpp"
 #include "../common/message.hpp"
+#include "../common/worker.hpp"
 #include <jsoncpp/json/json.h>
 namespace zrcrpc
 {
@@ -22,6 +23,52 @@ namespace zrcrpc
             OBJECT, // Json::Value对象
 
         };
+
+        class ServiceClosure
+        {
+            /*
+                异步服务的完成对象：异步业务函数拿到这个对象以后可以先返回，之后在任意线程里面调用response/fail给出结果
+                真正组织RpcResponse的动作还是交给Rpc_Router，这里只保证结果只会被提交一次
+                如果业务函数一直没有提交结果，最后一个引用释放的时候会自动返回INTERNAL_ERROR，避免客户端一直等待
+            */
+        public:
+            using Ptr = std::shared_ptr<ServiceClosure>;
+            using ResponseCallBack = std::function<void(const Json::Value &, RCode)>;
+            ServiceClosure(const ResponseCallBack &cb) : _done(false), _cb(cb) {}
+            ~ServiceClosure()
+            {
+                if (!_done.exchange(true))
+                {
+                    ELOG("异步服务没有给出结果");
+                    _cb(Json::Value(), RCode::INTERNAL_ERROR);
+                }
+            }
+            // 提交处理结果
+            void response(const Json::Value &result)
+            {
+                if (_done.exchange(true))
+                {
+                    ELOG("异步服务的结果重复提交");
+                    return;
+                }
+                _cb(result, RCode::OK);
+            }
+            // 提交错误码
+            void fail(RCode rcode)
+            {
+                if (_done.exchange(true))
+                {
+                    ELOG("异步服务的结果重复提交");
+                    return;
+                }
+                _cb(Json::Value(), rcode);
+            }
+
+        private:
+            std::atomic<bool> _done;
+            ResponseCallBack _cb;
+        };
+
         class ServiceDescribe
         {
             /*
@@ -31,9 +78,12 @@ namespace zrcrpc
         public:
             using Ptr = std::shared_ptr<ServiceDescribe>;
             using ServiceCallBack = std::function<void(const Json::Value &, Json::Value &)>;
+            // 异步业务函数，第二个参数是完成对象，业务函数可以在任意时刻、任意线程里面通过它提交结果
+            using AsyncServiceCallBack = std::function<void(const Json::Value &, const ServiceClosure::Ptr &)>;
             using ParamsDesc = std::pair<std::string, ParamType>; // 参数描述，比如"add"方法里面的参数就是"num1","num2" 都是对应INTEGRAL类型
-            ServiceDescribe(std::string &&name, std::vector<ParamsDesc> &&paramdesc, ServiceCallBack &&cb, ParamType &&rtype)
-                : _method_name(name), _param_desc(paramdesc), _call_back(cb), _rtype(rtype)
+            ServiceDescribe(std::string &&name, std::vector<ParamsDesc> &&paramdesc, ServiceCallBack &&cb,
+                            AsyncServiceCallBack &&async_cb, ParamType &&rtype)
+                : _method_name(name), _param_desc(paramdesc), _call_back(cb), _async_call_back(async_cb), _rtype(rtype)
             {
             }
 
@@ -70,12 +120,21 @@ namespace zrcrpc
                 }
                 return true;
             }
-
-        private:
-            bool CheckReturnValue(Json::Value val) const
+            // 异步调用，结果通过done提交
+            void AsyncCall(const Json::Value &params, const ServiceClosure::Ptr &done)
+            {
+                _async_call_back(params, done);
+            }
+            bool IsAsync() const
+            {
+                return static_cast<bool>(_async_call_back);
+            }
+            bool CheckReturnValue(const Json::Value &val) const
             {
                 return Check(val, _rtype);
             }
+
+        private:
             bool Check(Json::Value val, ParamType ptype) const
             {
                 switch (ptype)
@@ -99,8 +158,9 @@ namespace zrcrpc
         private:
             std::string _method_name;
             std::vector<ParamsDesc> _param_desc;
-            ServiceCallBack _call_back; // 实际的业务处理函数，比如"add"方法，那么第一个参数就是params参数，第二个参数就是result计算结果
-            ParamType _rtype;           // 返回值类型
+            ServiceCallBack _call_back;            // 实际的业务处理函数，比如"add"方法，那么第一个参数就是params参数，第二个参数就是result计算结果
+            AsyncServiceCallBack _async_call_back; // 异步的业务处理函数，设置了以后优先使用
+            ParamType _rtype;                      // 返回值类型
         };
 
         // 建造者模式，如果将接口都设置在ServiceDescribe里面，容易产生线程安全的问题
@@ -118,6 +178,7 @@ namespace zrcrpc
             void setServiceName(const std::string &name) { _name = name; }
             void setParamsDesc(const std::string &paramName, const ParamType &ptype) { _param_desc.emplace_back(paramName, ptype); }
             void setServiceServiceCallBack(const ServiceDescribe::ServiceCallBack &cb) { _call_back = cb; }
+            void setAsyncServiceCallBack(const ServiceDescribe::AsyncServiceCallBack &cb) { _async_call_back = cb; }
             void setRtype(const ParamType &rtype) { _rtype = rtype; }
 
             ServiceDescribe::Ptr build()
@@ -125,14 +186,16 @@ namespace zrcrpc
                 return std::make_shared<ServiceDescribe>(std::move(_name),
                                                          std::move(_param_desc),
                                                          std::move(_call_back),
+                                                         std::move(_async_call_back),
                                                          std::move(_rtype));
             }
 
         private:
             std::string _name;
             std::vector<ServiceDescribe::ParamsDesc> _param_desc;
-            ServiceDescribe::ServiceCallBack _call_back; // 根据参数计算结果的函数，由外部用户传入
-            ParamType _rtype;                            // 返回值类型
+            ServiceDescribe::ServiceCallBack _call_back;            // 根据参数计算结果的函数，由外部用户传入
+            ServiceDescribe::AsyncServiceCallBack _async_call_back; // 异步的计算函数，和_call_back二选一
+            ParamType _rtype;                                       // 返回值类型
         };
 
         class ServiceManager // 这个类实现对服务的管理，增删查改
@@ -181,47 +244,203 @@ namespace zrcrpc
             // 这个函数以后注册到dispatcher模块里面的业务处理函数, **** 这里是rpc请求处理类型的消息***
             // 参数里面就是外部传递进来的rpc请求消息，然后该函数进行处理，返回rpcrespnose消息
             void onRequest(const zrcrpc::BaseConnection::Ptr &conn, const zrcrpc::RpcRequest::Ptr &request)
+            {
+                // 请求里面带的是调用方还愿意等待的时间，收到请求的时候换算成本地的截止时间
+                // 在线程池里面排队的时间也算在里面
+                if (request->isValid() == false)
+                {
+                    ELOG("rpc请求格式错误，直接返回无效消息");
+                    response(conn, request, Json::Value(), RCode::INVALID_MSG);
+                    return;
+                }
+                Deadline deadline = toDeadline(request->timeout());
+
+                // 走到这里消息已经在IO线程里面解析完成了，如果设置了业务线程池，业务处理就交给工作线程
+                // 有序模式下按照连接来选择工作线程，同一个连接的请求按照到达的顺序处理
+                if (_workers)
+                {
+                    _workers->post(std::hash<BaseConnection *>()(conn.get()),
+                                   std::bind(&Rpc_Router::handleRequest, this, conn, request, deadline));
+                    return;
+                }
+                handleRequest(conn, request, deadline);
+            }
+
+            // 批量请求：里面的每个调用和单独的rpc请求走同样的处理流程，全部完成以后用一个批量响应返回
+            void onBatchRequest(const zrcrpc::BaseConnection::Ptr &conn, const zrcrpc::BatchRpcRequest::Ptr &request)
+            {
+                if (request->isValid() == false)
+                {
+                    ELOG("批量rpc请求格式错误，直接返回无效消息");
+                    auto msg = MessageFactory::create<BatchRpcResponse>();
+                    msg->setId(request->id());
+                    msg->setMessageType(zrcrpc::MType::RSP_BATCH_RPC);
+                    msg->setResponseCode(RCode::INVALID_MSG);
+                    conn->send(msg);
+                    return;
+                }
+                Deadline deadline = toDeadline(request->timeout());
+                if (_workers)
+                {
+                    _workers->post(std::hash<BaseConnection *>()(conn.get()),
+                                   std::bind(&Rpc_Router::handleBatchRequest, this, conn, request, deadline));
+                    return;
+                }
+                handleBatchRequest(conn, request, deadline);
+            }
+
+            // 这里注册新方法的时候，需要插入很多信息，所以这里创建了SDFactory工厂类
+            void registryMethod(ServiceDescribe::Ptr service)
+            {
+                _service_manager->insert(service);
+            }
+
+            // 设置业务线程池，必须在服务器启动之前设置
+            void setWorkerPool(const WorkerPool::Ptr &workers)
+            {
+                _workers = workers;
+            }
+            // 设置了业务线程池的时候，批量请求里面的调用分散到多个工作线程里面并行执行，必须在服务器启动之前设置
+            // 批量请求里面的调用之间没有先后顺序的保证
+            void setBatchParallel(bool parallel)
+            {
+                _batch_parallel = parallel;
+            }
+
+        private:
+            using Deadline = std::chrono::steady_clock::time_point;
+            using ResponseCallBack = ServiceClosure::ResponseCallBack;
+
+            // 批量请求的处理进度，每个调用只写自己下标的结果，最后一个完成的调用负责组织响应
+            struct BatchContext
+            {
+                using Ptr = std::shared_ptr<BatchContext>;
+                BatchContext(size_t n) : _results(n), _remaining(n) {}
+                std::vector<std::pair<RCode, Json::Value>> _results;
+                std::atomic<size_t> _remaining;
+            };
+
+            static Deadline toDeadline(int timeout_ms)
+            {
+                if (timeout_ms <= 0)
+                    return Deadline::max();
+                return std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            }
+
+            // 调用方已经放弃等待的请求就不再处理，把算力留给还有人等待的请求
+            bool expired(const Deadline &deadline) const
+            {
+                return deadline != Deadline::max() && std::chrono::steady_clock::now() >= deadline;
+            }
+
+            void handleRequest(const zrcrpc::BaseConnection::Ptr &conn, const zrcrpc::RpcRequest::Ptr &request, const Deadline &deadline)
+            {
+                execute(request->method(), request->params(), deadline,
+                        std::bind(&Rpc_Router::response, this, conn, request, std::placeholders::_1, std::placeholders::_2));
+            }
+
+            void handleBatchRequest(const zrcrpc::BaseConnection::Ptr &conn, const zrcrpc::BatchRpcRequest::Ptr &request, const Deadline &deadline)
+            {
+                size_t n = request->size();
+                auto ctx = std::make_shared<BatchContext>(n);
+                for (size_t i = 0; i < n; i++)
+                {
+                    auto done = std::bind(&Rpc_Router::onBatchDone, this, conn, request, ctx, i,
+                                          std::placeholders::_1, std::placeholders::_2);
+                    // 最后一个调用留在当前线程里面执行，其余的交给其他工作线程
+                    if (_workers && _batch_parallel && i + 1 < n)
+                    {
+                        _workers->post(std::bind(&Rpc_Router::execute, this, request->method(i), request->params(i), deadline,
+                                                 ResponseCallBack(done)));
+                        continue;
+                    }
+                    execute(request->method(i), request->params(i), deadline, done);
+                }
+            }
+
+            // 执行一个调用，结果通过done给出；异步服务的done可能在任意线程里面被调用
+            void execute(const std::string &method, const Json::Value &params, const Deadline &deadline, const ResponseCallBack &done)
             {
                 // 1. 查询客户端请求的方法描述--判断当前服务端能否提供对应的服务
-                std::string method = request->method();
                 ServiceDescribe::Ptr sdptr = _service_manager->select(method);
                 if (sdptr.get() == nullptr)
                 {
-                    ELOG("%s 服务未找到！", request->method().c_str());
-                    response(conn, request, Json::Value(), RCode::NOT_FOUND_SERVICE);
+                    ELOG("%s 服务未找到！", method.c_str());
+                    done(Json::Value(), RCode::NOT_FOUND_SERVICE);
                     return;
                 }
                 // 2. 进行参数校验，确定能否提供服务
-                bool canProvide = sdptr->PraseParam(request->params());
+                if (expired(deadline))
+                {
+                    ELOG("%s 请求已经超过截止时间，放弃处理", method.c_str());
+                    done(Json::Value(), RCode::DEADLINE_EXCEEDED);
+                    return;
+                }
+                bool canProvide = sdptr->PraseParam(params);
                 if (canProvide == false)
                 {
-                    ELOG("%s 服务参数校验失败！", request->method().c_str());
-                    response(conn, request, Json::Value(), RCode::INVALID_PARAMS);
+                    ELOG("%s 服务参数校验失败！", method.c_str());
+                    done(Json::Value(), RCode::INVALID_PARAMS);
+                    return;
+                }
+                // 3. 调用业务回调接口进行业务处理，参数校验也要花时间，执行之前再检查一次
+                if (expired(deadline))
+                {
+                    ELOG("%s 请求已经超过截止时间，放弃处理", method.c_str());
+                    done(Json::Value(), RCode::DEADLINE_EXCEEDED);
+                    return;
+                }
+                if (sdptr->IsAsync())
+                {
+                    // 异步服务：业务函数通过完成对象提交结果以后，再由onAsyncDone检查结果
+                    auto closure = std::make_shared<ServiceClosure>(std::bind(&Rpc_Router::onAsyncDone, this, method, sdptr, done,
+                                                                              std::placeholders::_1, std::placeholders::_2));
+                    sdptr->AsyncCall(params, closure);
                     return;
                 }
-                // 3. 调用业务回调接口进行业务处理
                 Json::Value result;
-                if (sdptr->Call(request->params(), result) == false)
+                if (sdptr->Call(params, result) == false)
                 {
-                    ELOG("%s 服务参数校验失败！", request->method().c_str());
-                    response(conn, request, Json::Value(), RCode::INTERNAL_ERROR);
+                    ELOG("%s 服务参数校验失败！", method.c_str());
+                    done(Json::Value(), RCode::INTERNAL_ERROR);
                     return;
                 }
-                // 4. 处理完毕得到结果，组织响应，向客户端发送
+                // 4. 处理完毕得到结果，交给done组织响应
+                done(result, RCode::OK);
+            }
 
-                // 这里很错误啊，要使用工厂，不要直接创建对象
-                //  zrcrpc::RpcResponse::Ptr resp = std::make_shared<zrcrpc::RpcResponse>();
-                response(conn, request, result, RCode::OK);
-                return;
+            // 异步服务提交结果以后的处理，可能在任意线程里面被调用
+            void onAsyncDone(const std::string &method, const ServiceDescribe::Ptr &sdptr, const ResponseCallBack &done,
+                             const Json::Value &result, RCode rcode)
+            {
+                if (rcode == RCode::OK && sdptr->CheckReturnValue(result) == false)
+                {
+                    ELOG("%s 返回值参数类型错误", method.c_str());
+                    done(Json::Value(), RCode::INTERNAL_ERROR);
+                    return;
+                }
+                done(result, rcode);
             }
 
-            // 这里注册新方法的时候，需要插入很多信息，所以这里创建了SDFactory工厂类
-            void registryMethod(ServiceDescribe::Ptr service)
+            // 批量请求里面的一个调用完成，全部完成以后按照请求里面的顺序组织批量响应
+            void onBatchDone(const BaseConnection::Ptr &conn, const BatchRpcRequest::Ptr &req, const BatchContext::Ptr &ctx,
+                             size_t index, const Json::Value &result, RCode rcode)
             {
-                _service_manager->insert(service);
+                ctx->_results[index] = std::make_pair(rcode, result);
+                if (ctx->_remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return;
+                auto msg = MessageFactory::create<BatchRpcResponse>();
+                msg->setId(req->id());
+                msg->setMessageType(zrcrpc::MType::RSP_BATCH_RPC);
+                msg->setResponseCode(RCode::OK);
+                for (auto &item : ctx->_results)
+                {
+                    msg->addResult(item.first, item.second);
+                }
+                conn->send(msg);
             }
 
-        private:
+            // 在工作线程里面调用的时候，muduo的TcpConnection::send会把发送操作投递回连接所属的IO线程
             void response(const BaseConnection::Ptr &conn,
                           const RpcRequest::Ptr &req,
                           const Json::Value &res, RCode rcode)
@@ -234,6 +453,8 @@ namespace zrcrpc
                 conn->send(msg);
             }
             ServiceManager::Ptr _service_manager;
+            WorkerPool::Ptr _workers; // 业务线程池，为空的时候直接在IO线程里面处理
+            bool _batch_parallel = false;
         };
     }
 }
\ No newline at end of file
@@ -36,6 +36,12 @@ namespace zrcrpc
                 _server->setCloseCallback(close_cb);
             }
 
+            // 设置IO线程数量，必须在start之前调用
+            void setThreadNum(int num)
+            {
+                _server->setThreadNum(num);
+            }
+
             void start()
             {
                 _server->start();
@@ -80,6 +86,9 @@ namespace zrcrpc
                 auto manager_cb = std::bind(&zrcrpc::server::Rpc_Router::onRequest, _router.get(),
                                             std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<RpcRequest>(zrcrpc::MType::REQ_RPC, manager_cb);
+                auto batch_cb = std::bind(&zrcrpc::server::Rpc_Router::onBatchRequest, _router.get(),
+                                          std::placeholders::_1, std::placeholders::_2);
+                _dispatcher->registryCallBack<BatchRpcRequest>(zrcrpc::MType::REQ_BATCH_RPC, batch_cb);
 
                 _server = ServerFactory::create(access_addr.second);
                 _server->setMessageCallback(message_cb);
@@ -94,6 +103,30 @@ namespace zrcrpc
                 _router->registryMethod(service);
             }
 
+            // 设置IO线程数量，必须在start之前调用
+            void setThreadNum(int num)
+            {
+                _server->setThreadNum(num);
+            }
+
+            // 设置业务线程数量，必须在start之前调用
+            // ordered为true的时候同一个连接上的请求按照到达顺序依次处理
+            void setWorkerThreadNum(int num, bool ordered = false)
+            {
+                if (num <= 0)
+                {
+                    ELOG("业务线程数量必须大于0");
+                    return;
+                }
+                _workers = WorkerPoolFactory::create(num, ordered);
+                _router->setWorkerPool(_workers);
+            }
+            // 批量请求里面的调用是否分散到多个业务线程里面并行执行，只有设置了业务线程的时候才起作用
+            void setBatchParallel(bool parallel)
+            {
+                _router->setBatchParallel(parallel);
+            }
+
             void start()
             {
                 _server->start();
@@ -103,6 +136,7 @@ namespace zrcrpc
             bool _enableRegClient;
             Dispatcher::Ptr _dispatcher;
             Rpc_Router::Ptr _router;
+            WorkerPool::Ptr _workers;
             Address _access_addr;
             client::RegistryClient::Ptr _reg_client;
             BaseServer::Ptr _server;
@@ -125,6 +159,9 @@ namespace zrcrpc
                 auto manager_cb = std::bind(&zrcrpc::server::PSManager::onTopicRequest, _psmanager.get(),
                                             std::placeholders::_1, std::placeholders::_2);
                 _dispatcher->registryCallBack<TopicRequest>(zrcrpc::MType::REQ_TOPIC, manager_cb);
+                auto batch_cb = std::bind(&zrcrpc::server::PSManager::onTopicBatchRequest, _psmanager.get(),
+                                          std::placeholders::_1, std::placeholders::_2);
+                _dispatcher->registryCallBack<TopicBatchRequest>(zrcrpc::MType::REQ_TOPIC_BATCH, batch_cb);
 
                 // 这是RegistryServer提供给server类的关闭连接的响应函数
                 auto close_cb = std::bind(&zrcrpc::server::TopicServer::onConnShutDown, this,
@@ -135,6 +172,37 @@ namespace zrcrpc
                 _server->setCloseCallback(close_cb);
             }
 
+            // 设置IO线程数量，必须在start之前调用
+            void setThreadNum(int num)
+            {
+                _server->setThreadNum(num);
+            }
+
+            // 开启主题日志，推送的消息带上offset，订阅者可以从指定的offset开始订阅，必须在start之前调用
+            void enableTopicLog(const std::string &dir, size_t segment_size = 64 * 1024 * 1024)
+            {
+                _psmanager->enableLog(dir, segment_size);
+                watchCongestion(); // 历史消息在输出缓冲区写空以后分批补发
+            }
+            // 开启合并推送，推给每个订阅者的消息攒够max_bytes字节或者等了linger_ms毫秒以后一次推送，必须在start之前调用
+            void enableBatching(size_t max_bytes = 64 * 1024, int linger_ms = 5)
+            {
+                _psmanager->enableBatching(max_bytes, linger_ms);
+            }
+
+            // 开启慢订阅者的处理：连接的输出缓冲区超过high_water_mark字节以后，推给它的报文最多排队max_queued_bytes字节，
+            // 队列满了以后按照policy处理，必须在start之前调用
+            void setSlowPolicy(size_t high_water_mark, size_t max_queued_bytes, SlowPolicy policy)
+            {
+                _psmanager->setSlowPolicy(high_water_mark, max_queued_bytes, policy);
+                watchCongestion();
+            }
+            // 每个订阅者连接丢掉的报文数量
+            std::unordered_map<BaseConnection::Ptr, uint64_t> droppedCounts()
+            {
+                return _psmanager->droppedCounts();
+            }
+
             void start()
             {
                 _server->start();
@@ -145,6 +213,12 @@ namespace zrcrpc
             {
                 _psmanager->onConnShutDown(conn);
             }
+            // 连接拥塞和输出缓冲区写空的时候通知PSManager，高水位以最后一次设置的为准
+            void watchCongestion()
+            {
+                _server->setCongestionCallback(_psmanager->highWaterMark(), std::bind(&zrcrpc::server::PSManager::onCongestion, _psmanager.get(),
+                                                                                      std::placeholders::_1, std::placeholders::_2));
+            }
 
         private:
             Dispatcher::Ptr _dispatcher;
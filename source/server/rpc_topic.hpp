@@ -1,7 +1,11 @@
 #pragma once
 #include "../common/net.hpp"
 #include "../common/message.hpp"
+#include "../common/topic_trie.hpp"
+#include "topic_log.hpp"
 #include <unordered_set>
+#include <list>
+#include <cctype>
 
 /*
     该模块实现的是主题的中转服务器：对主题的管理：创建，删除，订阅主题，取消订阅主题，主题消息的发布
@@ -12,12 +16,37 @@
         3、存在两个哈希：
         <主题，对应的订阅者集合> ：针对每一个主题，将订阅该主题的订阅者管理起来，方便后续主题的推送和订阅者断开连接时候的删除
         <连接，和对应的订阅者>   ：方便连接断开的时候找到对应的订阅者
+        4、订阅的时候可以使用通配符（md.eq.*、md.#），通配订阅不要求主题已经存在，统一放在一棵字典树里面，
+        发布消息的时候，订阅了这个主题的订阅者和通配订阅能匹配这个主题的订阅者都会收到消息，同一个订阅者只收到一次
+        5、开启主题日志以后，每个主题的消息按顺序追加到主题自己的日志里面，推送的消息里面带上消息的offset，
+        订阅的时候带上offset就会先从日志里面补发这个offset之后的消息，追上以后再接收实时推送，中间不丢也不重复
+        补发是分批进行的：每次最多补发高水位这么多字节，连接的输出缓冲区写空以后再补发下一批，补发不会长时间占住IO线程
+        主题删除的时候日志文件保留在磁盘上，重新创建同名主题以后offset接着往后增长
+        6、请求里面带着no_ack的时候处理完不返回响应，用在不需要确认的发布上
+        7、发布者可以用一个批量报文发布多条消息，不同主题的消息也可以放在一起
+        开启合并推送以后，每个主题的消息先攒在主题自己的批量报文里面，攒够字节数或者等了linger时间以后一次推送出去
+        批量报文和单条推送一样，每种编码方式只序列化一次，被这个主题的所有订阅者共享
+        linger定时器挂在攒下第一条消息的发布者连接的IO线程上，每个批量报文一个，最多等待linger时间
+        8、慢订阅者：连接的输出缓冲区越过高水位以后，推给这个订阅者的报文先放进它自己的按字节数限制的队列，
+        缓冲区每写空一次最多从队列里面发出高水位这么多字节，剩下的等下一次写空
+        队列满了以后按照策略丢掉最早的、丢掉最新的、同一个主题只保留最新的一条，或者直接断开连接，丢掉的报文数量按订阅者统计
+        这样一个订阅者最多占用两倍高水位加上队列上限这么多的内存，卡住的订阅者不会让服务端的内存一直增长
+        从offset补发的历史消息和实时推送一样经过这个队列和策略
 */
 
 namespace zrcrpc
 {
     namespace server
     {
+        // 慢订阅者的队列满了以后的处理策略
+        enum class SlowPolicy
+        {
+            DROP_OLDEST = 0, // 丢掉队列里面最早的报文
+            DROP_NEWEST,     // 丢掉新来的报文
+            CONFLATE,        // 同一个主题只保留最新的一条，队列里面都是不同的主题的时候丢掉最早的
+            DISCONNECT       // 断开连接
+        };
+
         /* PSManager = PublishSubsribeManager */
         class PSManager
         {
@@ -27,7 +56,8 @@ namespace zrcrpc
             {
             public:
                 using Ptr = std::shared_ptr<Subscriber>;
-                Subscriber(const BaseConnection::Ptr conn) : _conn(conn) {}
+                Subscriber(const BaseConnection::Ptr conn, size_t max_queued_bytes = 0, SlowPolicy policy = SlowPolicy::DROP_OLDEST)
+                    : _conn(conn), _max_queued_bytes(max_queued_bytes), _policy(policy), _queued_bytes(0), _dropped(0), _closing(false) {}
                 void addTopic(const std::string &topic)
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
@@ -37,75 +67,482 @@ namespace zrcrpc
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
                     _topics.erase(topic);
+                    eraseReplay(topic);
+                }
+                bool hasTopic(const std::string &topic)
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    return _topics.count(topic) > 0;
+                }
+                // 登记一个从日志补发的主题，同一个主题重新带着offset订阅的时候从新的offset开始
+                void addReplay(const std::string &topic, uint64_t from)
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    for (auto &replay : _replays)
+                    {
+                        if (replay._topic == topic)
+                        {
+                            replay._from = from;
+                            return;
+                        }
+                    }
+                    _replays.push_back(Replay{topic, from});
+                }
+                // 取出下一个要补发的主题，没有的时候返回false
+                bool nextReplay(std::string &topic, uint64_t &from)
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    if (_replays.empty())
+                        return false;
+                    topic = _replays.front()._topic;
+                    from = _replays.front()._from;
+                    return true;
+                }
+                void advanceReplay(const std::string &topic, uint64_t from)
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    for (auto &replay : _replays)
+                    {
+                        if (replay._topic == topic)
+                            replay._from = from;
+                    }
+                }
+                void finishReplay(const std::string &topic)
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    eraseReplay(topic);
+                }
+                std::vector<std::string> topics()
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    return std::vector<std::string>(_topics.begin(), _topics.end());
+                }
+                // 推送一个报文，key是报文对应的主题
+                void push(const std::string &key, const BaseConnection::Frame &frame)
+                {
+                    if (!frame)
+                        return;
+                    if (_max_queued_bytes == 0)
+                    {
+                        _conn->sendFrame(frame);
+                        return;
+                    }
+                    std::unique_lock<std::mutex> lock(_queue_mutex);
+                    if (_closing)
+                    {
+                        _dropped++;
+                        return;
+                    }
+                    // 前面还有排队的报文的时候也要排队，保证顺序
+                    if (_queue.empty() && !_conn->congested())
+                    {
+                        _conn->sendFrame(frame);
+                        return;
+                    }
+                    enqueue(key, frame);
+                }
+                // 连接的输出缓冲区写空了，最多发出budget字节的排队报文，一次全部发出去又会把输出缓冲区撑大
+                // 队列里面还有剩下的时候重新标记拥塞，这一批写空以后的写完成回调会再来取下一批
+                // 返回没有用完的字节数，还有剩下的报文的时候返回0
+                size_t drain(size_t budget)
+                {
+                    std::unique_lock<std::mutex> lock(_queue_mutex);
+                    while (!_queue.empty())
+                    {
+                        if (budget == 0)
+                        {
+                            _conn->setCongested(true);
+                            return 0;
+                        }
+                        size_t size = _queue.front()._frame->size();
+                        _conn->sendFrame(_queue.front()._frame);
+                        popFront();
+                        budget -= std::min(budget, size);
+                    }
+                    return budget;
+                }
+                uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+            private:
+                // 调用的时候要持有_mutex
+                void eraseReplay(const std::string &topic)
+                {
+                    for (auto it = _replays.begin(); it != _replays.end(); ++it)
+                    {
+                        if (it->_topic == topic)
+                        {
+                            _replays.erase(it);
+                            return;
+                        }
+                    }
+                }
+                // 调用的时候要持有_queue_mutex
+                // 队列按字节数限制，队列为空的时候超过上限的单个报文也放进去，否则永远发不出去
+                void enqueue(const std::string &key, const BaseConnection::Frame &frame)
+                {
+                    size_t size = frame->size();
+                    if (_policy == SlowPolicy::CONFLATE && !key.empty())
+                    {
+                        auto it = _latest.find(key);
+                        if (it != _latest.end())
+                        {
+                            // 原来的位置换成最新的报文
+                            _queued_bytes = _queued_bytes - it->second->_frame->size() + size;
+                            it->second->_frame = frame;
+                            _dropped++;
+                            return;
+                        }
+                    }
+                    if (!_queue.empty() && _queued_bytes + size > _max_queued_bytes)
+                    {
+                        if (_dropped.load(std::memory_order_relaxed) == 0)
+                            ILOG("订阅者的推送队列已满，开始丢弃报文");
+                        switch (_policy)
+                        {
+                        case SlowPolicy::DROP_NEWEST:
+                            _dropped++;
+                            return;
+                        case SlowPolicy::DISCONNECT:
+                            ELOG("订阅者读取太慢，断开连接");
+                            _closing = true;
+                            _dropped += _queue.size() + 1;
+                            _queue.clear();
+                            _latest.clear();
+                            _queued_bytes = 0;
+                            _conn->forceClose();
+                            return;
+                        default:
+                            while (!_queue.empty() && _queued_bytes + size > _max_queued_bytes)
+                            {
+                                popFront();
+                                _dropped++;
+                            }
+                            break;
+                        }
+                    }
+                    _queue.push_back(QueuedFrame{key, frame});
+                    _queued_bytes += size;
+                    if (_policy == SlowPolicy::CONFLATE && !key.empty())
+                        _latest[key] = std::prev(_queue.end());
+                }
+                void popFront()
+                {
+                    auto &front = _queue.front();
+                    if (!front._key.empty())
+                    {
+                        auto it = _latest.find(front._key);
+                        if (it != _latest.end() && it->second == _queue.begin())
+                            _latest.erase(it);
+                    }
+                    _queued_bytes -= front._frame->size();
+                    _queue.pop_front();
                 }
+                struct QueuedFrame
+                {
+                    std::string _key;
+                    BaseConnection::Frame _frame;
+                };
+                struct Replay
+                {
+                    std::string _topic;
+                    uint64_t _from; // 下一条要补发的消息的offset
+                };
 
             public:
                 std::mutex _mutex;
                 BaseConnection::Ptr _conn;               // 每个订阅者维护一个自己对应的连接
                 std::unordered_set<std::string> _topics; // 每个订阅者自己所订阅主题全部都管理起来
+                std::list<Replay> _replays;              // 还在从日志补发历史消息的主题，按照订阅的顺序一个一个补发，受_mutex保护
+                size_t _max_queued_bytes;                // 推送队列最多排队的字节数，0表示不限制，报文直接交给连接
+                SlowPolicy _policy;
+                std::mutex _queue_mutex;
+                std::list<QueuedFrame> _queue;                                                // 连接拥塞的时候排队的报文
+                size_t _queued_bytes;                                                         // 队列里面报文的总字节数
+                std::unordered_map<std::string, std::list<QueuedFrame>::iterator> _latest; // 主题--队列里面这个主题的报文，只有CONFLATE使用
+                std::atomic<uint64_t> _dropped;                                               // 丢掉的报文数量
+                bool _closing;                                                                // DISCONNECT策略已经断开了连接
+            };
+
+            // 合并推送的参数
+            struct Batcher
+            {
+                size_t _max_bytes; // 批量报文攒够这么多字节以后马上推送
+                double _linger;    // 批量报文里面第一条消息最多等待的秒数
+                static const size_t EntryOverhead = 16; // 每条消息在批量报文里面除了主题和消息以外的大概开销
             };
 
-            struct Topic
+            struct Topic : public std::enable_shared_from_this<Topic>
             {
+                /*
+                    订阅者集合使用写时复制：订阅和取消订阅的时候复制一份新的集合再原子地替换
+                    发布消息的时候原子地拿到当前集合的快照，不加锁，大量订阅者的广播不会阻塞订阅和取消订阅，反过来也一样
+                */
             public:
                 using Ptr = std::shared_ptr<Topic>;
-                Topic(const std::string &name) : _topic_name(name) {}
+                using SubscriberSet = std::unordered_set<Subscriber::Ptr>;
+                Topic(const std::string &name, const TopicLog::Ptr &log = TopicLog::Ptr())
+                    : _topic_name(name), _subscribers(std::make_shared<const SubscriberSet>()), _log(log), _batch_bytes(0), _batch_seq(0) {}
                 void addSubscriber(const Subscriber::Ptr &subscriber)
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-                    _subscribers.insert(subscriber);
+                    if (_subscribers->count(subscriber))
+                        return;
+                    auto subscribers = std::make_shared<SubscriberSet>(*_subscribers);
+                    subscribers->insert(subscriber);
+                    std::atomic_store(&_subscribers, std::shared_ptr<const SubscriberSet>(subscribers));
                 }
                 void removeSubscriber(const Subscriber::Ptr &subscriber)
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-                    _subscribers.erase(subscriber);
+                    if (_subscribers->count(subscriber) == 0)
+                        return;
+                    auto subscribers = std::make_shared<SubscriberSet>(*_subscribers);
+                    subscribers->erase(subscriber);
+                    std::atomic_store(&_subscribers, std::shared_ptr<const SubscriberSet>(subscribers));
                 }
-                void onPublish(const BaseMessage::Ptr &msg)
+                std::shared_ptr<const SubscriberSet> subscribers() const
                 {
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    for (auto &ptr : _subscribers)
+                    return std::atomic_load(&_subscribers);
+                }
+                // matched是通配订阅匹配到的订阅者，已经直接订阅了这个主题的订阅者不会重复收到
+                // batcher不为空的时候消息攒在批量报文里面合并推送，linger定时器挂在发布者连接conn的IO线程上
+                bool onPublish(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg, const std::vector<Subscriber::Ptr> &matched, Batcher *batcher)
+                {
+                    if (!_log)
+                    {
+                        batcher ? batch(conn, msg, matched, batcher) : fanout(msg, matched);
+                        return true;
+                    }
+                    // 追加日志和推送放在同一把锁里面，订阅者收到的offset一定是递增的
+                    std::unique_lock<std::mutex> lock(_log_mutex);
+                    uint64_t offset = 0;
+                    if (!_log->append(msg->message(), offset))
+                    {
+                        ELOG("主题%s的消息写入日志失败", _topic_name.c_str());
+                        return false;
+                    }
+                    msg->setOffset(offset);
+                    batcher ? batch(conn, msg, matched, batcher) : fanout(msg, matched);
+                    return true;
+                }
+                // 把还没有推送的批量报文马上推送出去
+                void flushBatch()
+                {
+                    std::unique_lock<std::mutex> lock(_batch_mutex);
+                    if (_batch)
+                        pushBatch();
+                }
+
+            private:
+                void fanout(const BaseMessage::Ptr &msg, const std::vector<Subscriber::Ptr> &matched)
+                {
+                    // 每种编码方式只序列化一次，编码好的报文被所有相同编码方式的订阅者连接共享
+                    BaseConnection::Frame frames[CodecNum];
+                    std::shared_ptr<const SubscriberSet> snapshot = subscribers();
+                    for (auto &ptr : *snapshot)
+                    {
+                        deliver(ptr, msg, frames);
+                    }
+                    // matched已经去重，只需要跳过直接订阅了这个主题的订阅者
+                    for (auto &ptr : matched)
+                    {
+                        if (snapshot->count(ptr))
+                            continue;
+                        deliver(ptr, msg, frames);
+                    }
+                }
+                void deliver(const Subscriber::Ptr &ptr, const BaseMessage::Ptr &msg, BaseConnection::Frame *frames)
+                {
+                    size_t codec = (size_t)ptr->_conn->codec();
+                    if (codec >= CodecNum)
                     {
-                        ptr->_conn->send(msg);
+                        ptr->push(_topic_name, ptr->_conn->frame(msg));
+                        return;
+                    }
+                    if (!frames[codec])
+                        frames[codec] = ptr->_conn->frame(msg);
+                    ptr->push(_topic_name, frames[codec]);
+                }
+                void batch(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg, const std::vector<Subscriber::Ptr> &matched, Batcher *batcher)
+                {
+                    std::unique_lock<std::mutex> lock(_batch_mutex);
+                    bool first = !_batch;
+                    if (first)
+                        _batch = MessageFactory::create<TopicBatchRequest>();
+                    std::string message = msg->message();
+                    msg->hasOffset() ? _batch->addEntry(_topic_name, message, msg->offset()) : _batch->addEntry(_topic_name, message);
+                    _batch_bytes += _topic_name.size() + message.size() + Batcher::EntryOverhead;
+                    _batch_matched = matched;
+                    if (_batch_bytes >= batcher->_max_bytes)
+                    {
+                        pushBatch(); // 攒够了直接推送，这个批量报文的linger定时器到时候会发现序号已经变了
+                        return;
                     }
+                    if (first)
+                    {
+                        std::weak_ptr<Topic> weak = shared_from_this();
+                        uint64_t seq = _batch_seq;
+                        conn->runAfter(batcher->_linger, [weak, seq]()
+                                       {
+                                           Topic::Ptr topic = weak.lock();
+                                           if (topic)
+                                               topic->onLinger(seq); });
+                    }
+                }
+                void onLinger(uint64_t seq)
+                {
+                    std::unique_lock<std::mutex> lock(_batch_mutex);
+                    if (_batch && _batch_seq == seq)
+                        pushBatch();
+                }
+                // 调用的时候要持有_batch_mutex，批量报文在这里只编码一次，推给所有的订阅者
+                void pushBatch()
+                {
+                    _batch->setId(UUID::uuid());
+                    _batch->setMessageType(MType::REQ_TOPIC_BATCH);
+                    fanout(_batch, _batch_matched);
+                    _batch.reset();
+                    _batch_matched.clear();
+                    _batch_bytes = 0;
+                    _batch_seq++;
                 }
 
             public:
+                static const size_t CodecNum = 2; // CodecType里面编码方式的数量
+                std::mutex _mutex;                // 只保护订阅者集合的修改，多个修改之间不能互相覆盖
+                std::string _topic_name;          // 维护一个主题自己的名字
+                std::shared_ptr<const SubscriberSet> _subscribers; // 将订阅了这个主题的所有的订阅者全部管理起来
+                TopicLog::Ptr _log;                                // 没有开启主题日志的时候为空
+                std::mutex _log_mutex;                             // 保证追加日志和推送的顺序一致，补发的最后一段也在这把锁里面
+                std::mutex _batch_mutex;                           // 保护合并推送的批量报文，推送也在这把锁里面，保证批量报文之间的顺序
+                TopicBatchRequest::Ptr _batch;                     // 还没有推送出去的消息，为空表示没有
+                std::vector<Subscriber::Ptr> _batch_matched;       // 最近一次发布的时候通配订阅匹配到的订阅者
+                size_t _batch_bytes;
+                uint64_t _batch_seq;                               // 批量报文的序号，linger定时器用它判断自己的批量报文是不是已经推送了
+            };
+
+            using PatternTrie = TopicTrie<Subscriber::Ptr>;
+
+            // 主题表按照主题名字分成多个分片，每个分片一把锁，不同主题的创建、订阅、发布大多落在不同的分片上
+            struct TopicShard
+            {
                 std::mutex _mutex;
-                std::string _topic_name;                          // 维护一个主题自己的名字
-                std::unordered_set<Subscriber::Ptr> _subscribers; // 将订阅了这个主题的所有的订阅者全部管理起来
+                std::unordered_map<std::string, Topic::Ptr> _topics; // 主题名字--主题对应的类
             };
 
         public:
             using Ptr = std::shared_ptr<PSManager>;
-            PSManager() {}
+            PSManager() : _segment_size(0), _high_water_mark(DefaultHighWaterMark), _max_queued_bytes(0), _slow_policy(SlowPolicy::DROP_OLDEST) {}
+
+            // 开启主题日志，之后创建的主题都会在dir下面有一个自己的日志目录，必须在服务启动之前调用
+            // 补发历史消息需要服务端在连接的输出缓冲区写空的时候调用onCongestion
+            void enableLog(const std::string &dir, size_t segment_size = 64 * 1024 * 1024)
+            {
+                _log_dir = dir;
+                _segment_size = segment_size;
+            }
+            // 开启合并推送：一个主题的消息攒够max_bytes字节或者等了linger_ms毫秒以后一次推送，必须在服务启动之前调用
+            void enableBatching(size_t max_bytes, int linger_ms)
+            {
+                _batcher.reset(new Batcher{max_bytes, (linger_ms > 0 ? linger_ms : 1) / 1000.0});
+            }
+            // 开启慢订阅者的处理：连接拥塞的时候每个订阅者最多排队max_queued_bytes字节的报文，队列满了以后按照policy处理
+            // high_water_mark和服务端的高水位相同，缓冲区每写空一次最多从队列里面发出这么多字节
+            // 服务端需要在连接拥塞和恢复的时候调用onCongestion，必须在服务启动之前调用
+            void setSlowPolicy(size_t high_water_mark, size_t max_queued_bytes, SlowPolicy policy)
+            {
+                _high_water_mark = high_water_mark > 0 ? high_water_mark : 1;
+                _max_queued_bytes = max_queued_bytes > 0 ? max_queued_bytes : 1;
+                _slow_policy = policy;
+            }
+            // 连接恢复的时候先发排队的报文，队列发完以后剩下的额度用来补发历史消息
+            void onCongestion(const BaseConnection::Ptr &conn, bool congested)
+            {
+                if (congested)
+                    return; // 拥塞的时候订阅者自己看连接的状态，不需要做什么
+                Subscriber::Ptr subscriber;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    auto it = _conns.find(conn);
+                    if (it == _conns.end())
+                        return;
+                    subscriber = it->second;
+                }
+                size_t budget = subscriber->drain(_high_water_mark);
+                if (budget > 0)
+                    resume(subscriber, budget);
+            }
+            size_t highWaterMark() const { return _high_water_mark; }
+            // 每个订阅者连接丢掉的报文数量
+            std::unordered_map<BaseConnection::Ptr, uint64_t> droppedCounts()
+            {
+                std::unordered_map<BaseConnection::Ptr, uint64_t> counts;
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (auto &it : _conns)
+                    counts[it.first] = it.second->dropped();
+                return counts;
+            }
 
         public:
             void onTopicRequest(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
                 // 实现主题的创建，删除，订阅主题，取消订阅主题，主题消息的发布
-                bool ret = true;
+                RCode rcode = RCode::OK;
+                // 通配符只能用在订阅和取消订阅上
+                if (PatternTrie::isPattern(msg->key()) && msg->operationType() != TopicOptype::TOPIC_SUBSCRIBE &&
+                    msg->operationType() != TopicOptype::TOPIC_CANCEL)
+                {
+                    ELOG("主题%s包含通配符，只能用来订阅", msg->key().c_str());
+                    return reply(conn, msg, msg->noAck(), RCode::INVALID_MSG);
+                }
                 switch (msg->operationType())
                 {
                 case TopicOptype::TOPIC_CREATE:
-                    topicCreate(conn, msg);
+                    rcode = topicCreate(conn, msg);
                     break;
                 case TopicOptype::TOCPIC_REMOVE:
                     topicRemove(conn, msg);
                     break;
                 case TopicOptype::TOPIC_SUBSCRIBE:
-                    ret = topicSubscriber(conn, msg);
+                    rcode = topicSubscriber(conn, msg);
                     break;
                 case TopicOptype::TOPIC_CANCEL:
                     topicCancelSubscriber(conn, msg);
                     break;
                 case TopicOptype::TOPIC_PUBLISH:
-                    ret = topicPublish(conn, msg);
+                    rcode = topicPublish(conn, msg);
                     break;
 
                 default:
-                    return errResponse(conn, msg, RCode::INVALID_OPTYPE);
+                    return reply(conn, msg, msg->noAck(), RCode::INVALID_OPTYPE);
+                }
+                reply(conn, msg, msg->noAck(), rcode);
+            }
+            // 批量发布：每条消息单独发布，互相不影响，只返回一个响应，有消息发布失败的时候返回第一个错误
+            void onTopicBatchRequest(const BaseConnection::Ptr &conn, const TopicBatchRequest::Ptr &msg)
+            {
+                RCode rcode = RCode::OK;
+                for (size_t i = 0; i < msg->size(); i++)
+                {
+                    auto entry = MessageFactory::create<TopicRequest>();
+                    entry->setId(msg->id());
+                    entry->setMessageType(MType::REQ_TOPIC);
+                    entry->setOperationType(TopicOptype::TOPIC_PUBLISH);
+                    entry->setKey(msg->key(i));
+                    entry->setMessage(msg->message(i));
+                    RCode ret = RCode::INVALID_MSG;
+                    if (PatternTrie::isPattern(entry->key()))
+                    {
+                        ELOG("主题%s包含通配符，只能用来订阅", entry->key().c_str());
+                    }
+                    else
+                    {
+                        ret = topicPublish(conn, entry);
+                    }
+                    if (rcode == RCode::OK)
+                        rcode = ret;
                 }
-                ret == false ? errResponse(conn, msg, RCode::NOT_FOUND_TOPIC) : topicResponse(conn, msg);
+                reply(conn, msg, msg->noAck(), rcode);
             }
             void onConnShutDown(const BaseConnection::Ptr &conn)
             {
@@ -113,7 +550,6 @@ namespace zrcrpc
                 // 2、找到订阅者连接，找到和订阅者有关系的主题全部保存起来
                 // 3、遍历所有相关的主题，然后删除主题里面的订阅者
                 // 4、删除_conns的连接
-                std::vector<Topic::Ptr> topics;
                 Subscriber::Ptr subscriber;
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
@@ -121,24 +557,34 @@ namespace zrcrpc
                     if (it_conn == _conns.end())
                         return;
                     subscriber = it_conn->second;
-                    // 由于subscriber里面维护的string集合，这里遍历string集合
-                    for (auto &topic_name : subscriber->_topics)
-                    {
-                        // 通过_topics找到topicname对应的Topic::Ptr
-                        auto it_topic = _topics.find(topic_name);
-                        if (it_topic == _topics.end())
-                            continue;
-                        topics.emplace_back(it_topic->second);
-                    }
-                    _conns.erase(conn);
+                    _conns.erase(it_conn);
                 }
-                for (auto &e : topics)
+                // 由于subscriber里面维护的string集合，这里遍历string集合，通过主题表找到对应的Topic::Ptr
+                for (auto &topic_name : subscriber->topics())
                 {
-                    e->removeSubscriber(subscriber);
+                    if (PatternTrie::isPattern(topic_name))
+                    {
+                        _patterns.remove(topic_name, subscriber);
+                        continue;
+                    }
+                    Topic::Ptr topic = findTopic(topic_name);
+                    if (topic)
+                        topic->removeSubscriber(subscriber);
                 }
             }
 
         private:
+            // 不需要确认的请求不返回响应，出错的时候只记录日志
+            void reply(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg, bool no_ack, const RCode &rcode)
+            {
+                if (no_ack)
+                {
+                    if (rcode != RCode::OK)
+                        ELOG("主题请求处理失败：%s", ErrReason(rcode).c_str());
+                    return;
+                }
+                rcode != RCode::OK ? errResponse(conn, msg, rcode) : topicResponse(conn, msg);
+            }
             void errResponse(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg, const RCode &rcode)
             {
                 // 直接返回错误的消息
@@ -158,93 +604,199 @@ namespace zrcrpc
                 conn->send(resp_msg);
             }
 
+            TopicShard &shard(const std::string &topic_name)
+            {
+                return _shards[std::hash<std::string>()(topic_name) % ShardNum];
+            }
+            Topic::Ptr findTopic(const std::string &topic_name)
+            {
+                TopicShard &sd = shard(topic_name);
+                std::unique_lock<std::mutex> lock(sd._mutex);
+                auto it = sd._topics.find(topic_name);
+                if (it == sd._topics.end())
+                    return Topic::Ptr();
+                return it->second;
+            }
+
             // 根据msg里面的信息创建一个主题
-            void topicCreate(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
+            RCode topicCreate(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
-                //_topics里面加入一个主题
+                //_topics里面加入一个主题，主题已经存在的时候什么都不做
                 std::string topic_name = msg->key();
-                Topic::Ptr topic = std::make_shared<Topic>(topic_name);
+                TopicShard &sd = shard(topic_name);
+                std::unique_lock<std::mutex> lock(sd._mutex);
+                if (sd._topics.find(topic_name) != sd._topics.end())
+                    return RCode::OK;
+                TopicLog::Ptr log;
+                if (!_log_dir.empty())
                 {
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    auto it = _topics.find(topic_name);
-                    if (it != _topics.end())
-                        return;
-                    else
+                    // 日志目录已经存在的时候会加载原来的消息，offset接着往后增长
+                    log = std::make_shared<TopicLog>(_log_dir + "/" + logName(topic_name), _segment_size);
+                    if (!log->open())
+                        return RCode::INTERNAL_ERROR;
+                }
+                sd._topics[topic_name] = std::make_shared<Topic>(topic_name, log);
+                return RCode::OK;
+            }
+            // 主题名字里面除了字母、数字、'.'、'-'、'_'以外的字符都转成%XX，开头的'.'也转，保证是一个合法的目录名字
+            static std::string logName(const std::string &topic_name)
+            {
+                std::string name;
+                for (size_t i = 0; i < topic_name.size(); i++)
+                {
+                    unsigned char c = topic_name[i];
+                    if (isalnum(c) || c == '-' || c == '_' || (c == '.' && i != 0))
                     {
-                        _topics[topic_name] = topic;
-                        return;
+                        name.push_back(c);
+                        continue;
                     }
+                    char buf[4];
+                    snprintf(buf, sizeof(buf), "%%%02X", c);
+                    name += buf;
                 }
+                return name;
             }
 
             // 根据msg里面的信息去移除一个主题
             void topicRemove(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
-                // 1、首先找到一个topic_name对应的topic主题
-                // 2、然后根据先根据topic找到每个订阅者，先删除订阅者里面的topic
-                // 3、最后删除_topics里面的连接
+                // 1、首先找到一个topic_name对应的topic主题，从主题表里面删除
+                // 2、然后根据topic的订阅者快照找到每个订阅者，在锁外面删除订阅者里面的topic
                 Topic::Ptr topic;
-                std::unordered_set<Subscriber::Ptr> subscribers;
-
                 {
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    auto it_topic = _topics.find(msg->key());
-                    if (it_topic == _topics.end())
+                    TopicShard &sd = shard(msg->key());
+                    std::unique_lock<std::mutex> lock(sd._mutex);
+                    auto it_topic = sd._topics.find(msg->key());
+                    if (it_topic == sd._topics.end())
                     {
                         // 这里直接就是主题都没找到，直接返回成功就好
                         return;
                     }
                     topic = it_topic->second; // 找到主题连接
-
-                    // 这里将topic里面的订阅者集合取出来，在锁外面去删除
-                    subscribers = topic->_subscribers;
-                    _topics.erase(it_topic);
+                    sd._topics.erase(it_topic);
                 }
-                for (auto &sub : subscribers)
+                topic->flushBatch(); // 删除之前已经发布的消息照常推送
+                for (auto &sub : *topic->subscribers())
                 {
                     sub->removeTopic(topic->_topic_name);
                 }
             }
 
             // 根据msg里面的信息对目标主题，进行订阅，订阅连接就是conn
-            bool topicSubscriber(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
+            Subscriber::Ptr getSubscriber(const BaseConnection::Ptr &conn)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                // 根据连接找到对应的订阅者，一般来说，找不到是正常的
+                auto it_sub = _conns.find(conn);
+                if (it_sub != _conns.end())
+                    return it_sub->second;
+                // 找不到就创建一个订阅者，修改_conns
+                Subscriber::Ptr subscriber = std::make_shared<Subscriber>(conn, _max_queued_bytes, _slow_policy);
+                _conns[conn] = subscriber;
+                return subscriber;
+            }
+
+            RCode topicSubscriber(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
                 // 1、 先判断主题是否存在，如果不存在就返回false，创建主题以后增加订阅
                 // 2、根据连接找到对应的订阅者，不存在就创建订阅者，订阅者增加主题
-                // 3、修改_topics和_conns
-                Topic::Ptr topic;
-                Subscriber::Ptr subscriber;
+                // 通配订阅不要求主题已经存在，之后创建的主题只要能匹配上也会收到
+                if (PatternTrie::isPattern(msg->key()))
                 {
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    auto it_topic = _topics.find(msg->key());
-                    if (it_topic == _topics.end())
+                    Subscriber::Ptr subscriber = getSubscriber(conn);
+                    subscriber->addTopic(msg->key());
+                    _patterns.insert(msg->key(), subscriber);
+                    return RCode::OK;
+                }
+                Topic::Ptr topic = findTopic(msg->key());
+                if (!topic)
+                {
+                    // 主题都没有，直接返回错误
+                    return RCode::NOT_FOUND_TOPIC;
+                }
+                Subscriber::Ptr subscriber = getSubscriber(conn);
+
+                // 订阅者里面先添加主题，再让主题看到订阅者
+                subscriber->addTopic(topic->_topic_name);
+                if (!topic->_log || !msg->hasOffset())
+                {
+                    // 这里如果不是新建的订阅者，在该函数中也会判断是否存在的，存在就直接返回
+                    // 之前带着offset订阅还没有补发完的时候，不再补发，直接接收实时推送
+                    subscriber->finishReplay(topic->_topic_name);
+                    topic->addSubscriber(subscriber);
+                    return RCode::OK;
+                }
+                // 带着offset订阅：登记补发，历史消息在IO线程里面分批补发，追上以后再加入订阅者集合
+                // 连接正在拥塞的时候等输出缓冲区写空以后再开始
+                subscriber->addReplay(topic->_topic_name, msg->offset());
+                if (!conn->congested())
+                    resume(subscriber, _high_water_mark);
+                return RCode::OK;
+            }
+            // 补发最多budget字节的历史消息，补发的报文和实时推送一样经过订阅者的队列
+            // 还没有补发完的时候标记拥塞，这一批写空以后的写完成回调会通过onCongestion接着补发
+            void resume(const Subscriber::Ptr &subscriber, size_t budget)
+            {
+                std::string topic_name;
+                uint64_t from = 0;
+                std::vector<TopicLog::Record> records;
+                while (subscriber->nextReplay(topic_name, from))
+                {
+                    Topic::Ptr topic = findTopic(topic_name);
+                    if (!topic || !topic->_log || !subscriber->hasTopic(topic_name) || subscriber->_conn->isClosed())
                     {
-                        // 主题都没有，直接返回false
-                        return false;
+                        // 主题已经删除、取消了订阅或者连接已经断开，不再补发
+                        subscriber->finishReplay(topic_name);
+                        continue;
                     }
-
-                    topic = it_topic->second;
-                    // 根据连接找到对应的订阅者，一般来说，找不到是正常的
-                    auto it_sub = _conns.find(conn);
-                    if (it_sub != _conns.end())
+                    if (budget == 0)
                     {
-                        subscriber = it_sub->second;
+                        subscriber->_conn->setCongested(true);
+                        return;
                     }
-                    else // 找不到就创建一个订阅者，修改_conns
+                    records.clear();
+                    topic->_log->read(from, ReplayBatch, records);
+                    if (records.size() == ReplayBatch)
                     {
-                        // 创建订阅者
-                        subscriber = std::make_shared<Subscriber>(conn);
-                        _conns[conn] = subscriber;
+                        // 大部分历史消息在锁外面补发，不阻塞发布
+                        size_t i = 0;
+                        while (i < records.size() && budget > 0)
+                            budget -= std::min(budget, replay(subscriber, topic_name, records[i++]));
+                        subscriber->advanceReplay(topic_name, records[i - 1].first + 1);
+                        continue;
                     }
+                    // 剩下不到一批的时候拿着日志锁补发最后一段，然后加入订阅者集合，之后的消息走实时推送
+                    std::unique_lock<std::mutex> lock(topic->_log_mutex);
+                    do
+                    {
+                        records.clear();
+                        topic->_log->read(from, ReplayBatch, records);
+                        for (auto &record : records)
+                            budget -= std::min(budget, replay(subscriber, topic_name, record));
+                        if (!records.empty())
+                            from = records.back().first + 1;
+                    } while (records.size() == ReplayBatch);
+                    // 还没有推送的批量报文里面的消息已经补发过了，先推给原来的订阅者
+                    topic->flushBatch();
+                    topic->addSubscriber(subscriber);
+                    subscriber->finishReplay(topic_name);
                 }
-
-                // 主题增加订阅者
-                // 这里如果不是新建的订阅者，在该函数中也会判断是否存在的，存在就插入失败
-                topic->addSubscriber(subscriber);
-
-                // 订阅者里面添加主题
-                subscriber->addTopic(topic->_topic_name);
-                return true;
+            }
+            // 把日志里面读出来的一条消息按照推送的格式交给订阅者，返回报文的字节数
+            static size_t replay(const Subscriber::Ptr &subscriber, const std::string &topic_name, const TopicLog::Record &record)
+            {
+                auto push_msg = MessageFactory::create<TopicRequest>();
+                push_msg->setId(UUID::uuid());
+                push_msg->setMessageType(MType::REQ_TOPIC);
+                push_msg->setOperationType(TopicOptype::TOPIC_PUBLISH);
+                push_msg->setKey(topic_name);
+                push_msg->setMessage(record.second);
+                push_msg->setOffset(record.first);
+                BaseConnection::Frame frame = subscriber->_conn->frame(push_msg);
+                if (!frame)
+                    return 0;
+                subscriber->push(topic_name, frame);
+                return frame->size();
             }
 
             // 根据msg里面的信息对目标主题，进行取消订阅
@@ -253,52 +805,52 @@ namespace zrcrpc
                 // 1、首先找到主题
                 // 2、找到主题对应的连接，先删除订阅者里面的主题
                 // 3、最后删除主题里面的连接
-                Topic::Ptr topic;
                 Subscriber::Ptr subscriber;
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-
-                    // 找到主题
-                    auto it_topic = _topics.find(msg->key());
-                    if (it_topic != _topics.end())
-                        topic = it_topic->second;
-                    else
-                        return;
-
-                    // 找到连接
                     auto it_sub = _conns.find(conn);
-                    if (it_sub != _conns.end())
-                        subscriber = it_sub->second;
-                    else
+                    if (it_sub == _conns.end())
                         return;
-                    // _conns.erase(conn);
+                    subscriber = it_sub->second;
                 }
-                if (subscriber)
-                    subscriber->removeTopic(topic->_topic_name);
-
-                if (topic && subscriber)
-                    topic->removeSubscriber(subscriber);
+                if (PatternTrie::isPattern(msg->key()))
+                {
+                    subscriber->removeTopic(msg->key());
+                    _patterns.remove(msg->key(), subscriber);
+                    return;
+                }
+                Topic::Ptr topic = findTopic(msg->key());
+                if (!topic)
+                    return;
+                subscriber->removeTopic(topic->_topic_name);
+                topic->removeSubscriber(subscriber);
             }
 
-            // 根据msg里面的信息对目标主题进行消息发布
-            bool topicPublish(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
+            // 根据msg里面的信息对目标主题进行消息发布，只在查找主题的时候短暂地持有一个分片的锁
+            RCode topicPublish(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &msg)
             {
-                Topic::Ptr topic;
-                {
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    // 找到主题
-                    auto it_topic = _topics.find(msg->key());
-                    if (it_topic == _topics.end())
-                        return false;
-                    topic = it_topic->second;
-                }
-                topic->onPublish(msg);
-                return true;
+                Topic::Ptr topic = findTopic(msg->key());
+                if (!topic)
+                    return RCode::NOT_FOUND_TOPIC;
+                // 通配订阅的匹配同样读取的是快照，不加锁
+                std::vector<Subscriber::Ptr> matched;
+                _patterns.match(msg->key(), matched);
+                return topic->onPublish(conn, msg, matched, _batcher.get()) ? RCode::OK : RCode::INTERNAL_ERROR;
             }
 
         private:
-            std::mutex _mutex;
-            std::unordered_map<std::string, Topic::Ptr> _topics; // 主题名字--主题对应的类
+            static const size_t ShardNum = 16;
+            static const size_t ReplayBatch = 256; // 补发历史消息的时候每次从日志里面读取的条数
+            static const size_t DefaultHighWaterMark = 4 * 1024 * 1024; // 没有设置慢订阅者处理的时候，每一批补发的字节数
+            std::string _log_dir;                  // 为空表示没有开启主题日志
+            size_t _segment_size;
+            std::unique_ptr<Batcher> _batcher; // 为空表示没有开启合并推送
+            size_t _high_water_mark;
+            size_t _max_queued_bytes; // 0表示没有开启慢订阅者的处理
+            SlowPolicy _slow_policy;
+            TopicShard _shards[ShardNum];
+            PatternTrie _patterns; // 通配订阅 -- 订阅者
+            std::mutex _mutex; // 只保护_conns
             // 这里的_conns是提供的onshutdown函数使用的，一般只有断开连接的时候才使用这个函数去删除
             // 之间是Topic里面存储的是BaseConnection::Ptr连接，所以会用到_conns，现在里面是Subscriber就不需要使用_conns
             std::unordered_map<BaseConnection::Ptr, Subscriber::Ptr> _conns; // 连接 --- 订阅者（里面包含连接）
@@ -0,0 +1,266 @@
+/*
+    主题的追加日志：发布到主题上的消息按照顺序追加到磁盘上，每条消息有一个单调递增的offset
+    1、日志由多个段文件组成，段文件的名字是段里面第一条消息的offset，每个段文件预先分配好大小并且映射到内存，写满以后新建一个段
+    2、段文件里面的记录格式：|--magic(4)--|--len(4)--|--消息--|，offset不写在记录里面，等于段的起始offset加上记录在段里面的序号
+       段文件预先分配的部分都是0，magic对不上的位置就是段的末尾，重启的时候扫描一遍就能恢复出每个段的记录位置
+    3、订阅者断线重连以后可以从指定的offset开始顺序读取，追上以后再接收实时的推送
+    数据写在共享的内存映射里面，进程崩溃的时候不会丢失，但是不保证机器掉电的时候已经落盘
+*/
+#pragma once
+#include "../common/detail.hpp"
+#include <map>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace zrcrpc
+{
+    namespace server
+    {
+        class TopicLog
+        {
+        public:
+            using Ptr = std::shared_ptr<TopicLog>;
+            using Record = std::pair<uint64_t, std::string>; // offset -- 消息
+
+            TopicLog(const std::string &dir, size_t segment_size = DefaultSegmentSize)
+                : _dir(dir), _segment_size(segment_size > HeaderLength ? segment_size : DefaultSegmentSize) {}
+
+            // 创建目录，加载已经存在的段文件，恢复下一条消息的offset
+            bool open()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (!makeDirs(_dir))
+                {
+                    ELOG("创建主题日志目录%s失败", _dir.c_str());
+                    return false;
+                }
+                DIR *dp = ::opendir(_dir.c_str());
+                if (dp == nullptr)
+                {
+                    ELOG("打开主题日志目录%s失败", _dir.c_str());
+                    return false;
+                }
+                std::vector<uint64_t> bases;
+                while (struct dirent *entry = ::readdir(dp))
+                {
+                    uint64_t base = 0;
+                    if (parseName(entry->d_name, base))
+                        bases.push_back(base);
+                }
+                ::closedir(dp);
+                for (uint64_t base : bases)
+                {
+                    auto seg = std::make_shared<Segment>(base);
+                    if (!seg->open(segmentPath(base), 0))
+                        return false;
+                    _segments[base] = seg;
+                }
+                _next = _segments.empty() ? 0 : _segments.rbegin()->second->endOffset();
+                return true;
+            }
+
+            // 追加一条消息，返回它的offset
+            bool append(const std::string &data, uint64_t &offset)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                size_t need = HeaderLength + data.size();
+                if (_segments.empty() || !_segments.rbegin()->second->hasRoom(need))
+                {
+                    // 单条消息比段还大的时候，这个段就只放这一条消息
+                    auto seg = std::make_shared<Segment>(_next);
+                    if (!seg->open(segmentPath(_next), std::max(_segment_size, need)))
+                        return false;
+                    _segments[_next] = seg;
+                }
+                _segments.rbegin()->second->append(data);
+                offset = _next++;
+                return true;
+            }
+
+            // 下一条消息的offset，也就是当前已经写入的消息数量
+            uint64_t endOffset()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                return _next;
+            }
+
+            // 从from开始顺序读取最多max_count条消息，from超过末尾的时候什么都不读
+            // from比最早的消息还小的时候从最早的消息开始
+            void read(uint64_t from, size_t max_count, std::vector<Record> &out)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_segments.empty() || from >= _next)
+                    return;
+                auto it = _segments.upper_bound(from);
+                if (it != _segments.begin())
+                    --it;
+                from = std::max(from, it->first);
+                for (; it != _segments.end() && max_count > 0; ++it)
+                {
+                    size_t n = it->second->read(from, max_count, out);
+                    max_count -= n;
+                    from += n;
+                }
+            }
+
+        private:
+            class Segment
+            {
+            public:
+                using Ptr = std::shared_ptr<Segment>;
+                Segment(uint64_t base) : _base(base), _fd(-1), _data(nullptr), _capacity(0), _size(0) {}
+                // 打开到一半失败的段也会在这里释放文件和映射
+                ~Segment() { close(); }
+                Segment(const Segment &) = delete;
+                Segment &operator=(const Segment &) = delete;
+
+                // capacity为0的时候打开已经存在的段文件，按照文件大小映射，扫描出所有的记录
+                bool open(const std::string &path, size_t capacity)
+                {
+                    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+                    if (_fd < 0)
+                    {
+                        ELOG("打开段文件%s失败", path.c_str());
+                        return false;
+                    }
+                    struct stat st;
+                    if (::fstat(_fd, &st) < 0)
+                        return false;
+                    _capacity = capacity > 0 ? capacity : (size_t)st.st_size;
+                    if ((size_t)st.st_size < _capacity && ::ftruncate(_fd, _capacity) < 0)
+                    {
+                        ELOG("段文件%s分配空间失败", path.c_str());
+                        return false;
+                    }
+                    if (_capacity == 0)
+                        return true;
+                    void *addr = ::mmap(nullptr, _capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+                    if (addr == MAP_FAILED)
+                    {
+                        ELOG("段文件%s映射失败", path.c_str());
+                        return false;
+                    }
+                    _data = static_cast<char *>(addr);
+                    recover();
+                    return true;
+                }
+                void close()
+                {
+                    if (_data)
+                        ::munmap(_data, _capacity);
+                    if (_fd >= 0)
+                        ::close(_fd);
+                    _data = nullptr;
+                    _fd = -1;
+                }
+
+                bool hasRoom(size_t need) const { return _size + need <= _capacity; }
+                uint64_t endOffset() const { return _base + _positions.size(); }
+
+                void append(const std::string &data)
+                {
+                    uint32_t len = data.size();
+                    ::memcpy(_data + _size + MagicLength, &len, LenLength);
+                    ::memcpy(_data + _size + HeaderLength, data.data(), data.size());
+                    // magic最后写，记录写完整以后才算存在
+                    uint32_t magic = Magic;
+                    ::memcpy(_data + _size, &magic, MagicLength);
+                    _positions.push_back(_size);
+                    _size += HeaderLength + data.size();
+                }
+                size_t read(uint64_t from, size_t max_count, std::vector<Record> &out) const
+                {
+                    size_t count = 0;
+                    for (uint64_t i = from - _base; i < _positions.size() && count < max_count; i++, count++)
+                    {
+                        uint32_t len = 0;
+                        ::memcpy(&len, _data + _positions[i] + MagicLength, LenLength);
+                        out.emplace_back(_base + i, std::string(_data + _positions[i] + HeaderLength, len));
+                    }
+                    return count;
+                }
+
+            private:
+                void recover()
+                {
+                    while (_size + HeaderLength <= _capacity)
+                    {
+                        uint32_t magic = 0, len = 0;
+                        ::memcpy(&magic, _data + _size, MagicLength);
+                        ::memcpy(&len, _data + _size + MagicLength, LenLength);
+                        if (magic != Magic || _size + HeaderLength + len > _capacity)
+                            break;
+                        _positions.push_back(_size);
+                        _size += HeaderLength + len;
+                    }
+                }
+
+            private:
+                uint64_t _base; // 段里面第一条消息的offset
+                int _fd;
+                char *_data;
+                size_t _capacity;
+                size_t _size;                    // 已经写入的字节数
+                std::vector<size_t> _positions; // 每条记录在段里面的位置
+            };
+
+            std::string segmentPath(uint64_t base) const
+            {
+                char name[NameLength + 1];
+                snprintf(name, sizeof(name), "%020llu", (unsigned long long)base);
+                return _dir + "/" + name + suffix();
+            }
+            static const char *suffix() { return ".log"; }
+            // 目录里面不是段文件的名字(别人放进来的文件、编辑器的临时文件)直接跳过
+            static bool parseName(const std::string &name, uint64_t &base)
+            {
+                if (name.size() != NameLength + strlen(suffix()) || name.compare(NameLength, std::string::npos, suffix()) != 0)
+                    return false;
+                if (!std::all_of(name.begin(), name.begin() + NameLength, [](char c)
+                                 { return c >= '0' && c <= '9'; }))
+                    return false;
+                errno = 0;
+                unsigned long long val = ::strtoull(name.c_str(), nullptr, 10);
+                if (errno == ERANGE)
+                    return false;
+                base = val;
+                return true;
+            }
+            static bool makeDirs(const std::string &dir)
+            {
+                for (size_t pos = 1; pos <= dir.size(); pos++)
+                {
+                    if (pos != dir.size() && dir[pos] != '/')
+                        continue;
+                    std::string sub = dir.substr(0, pos);
+                    if (::mkdir(sub.c_str(), 0755) < 0 && errno != EEXIST)
+                        return false;
+                }
+                return true;
+            }
+
+        private:
+            static const size_t DefaultSegmentSize = 64 * 1024 * 1024;
+            static const size_t NameLength = 20;
+            static const uint32_t Magic = 0x5A52434C;
+            static const size_t MagicLength = 4;
+            static const size_t LenLength = 4;
+            static const size_t HeaderLength = MagicLength + LenLength;
+            std::string _dir;
+            size_t _segment_size;
+            std::mutex _mutex;
+            std::map<uint64_t, Segment::Ptr> _segments; // 段的起始offset -- 段
+            uint64_t _next = 0;                          // 下一条消息的offset
+        };
+    }
+}
@@ -36,7 +36,7 @@ int main()
     client->connect();
 
     auto req = MessageFactory::create<RpcRequest>();
-    req->setId("12312");
+    req->setId(12312);
     req->setMethod("Add");
     req->setMessageType(MType::REQ_RPC);
     Json::Value paramas;
@@ -49,7 +49,7 @@ int main()
     std::this_thread::sleep_for(std::chrono::seconds(3));
     // 设置Topic请求
     auto req2 = MessageFactory::create<TopicRequest>();
-    req2->setId("12313");
+    req2->setId(12313);
     req->setMethod("Add");
     req2->setMessageType(MType::REQ_TOPIC);
     req2->setKey("topic");
@@ -12,7 +12,7 @@ void onRpcMessage(const BaseConnection::Ptr &conn, const RpcRequest::Ptr &msg)
     std::string body = msg->serialize();
     std::cout << body << std::endl;
     auto resp = MessageFactory::create<RpcResponse>();
-    resp->setId("12312");
+    resp->setId(12312);
     resp->setMessageType(MType::RSP_RPC);
     resp->setResponseCode(RCode::OK);
     Json::Value result;
@@ -25,7 +25,7 @@ void onTopicMessage(const BaseConnection::Ptr &conn, const TopicRequest::Ptr &ms
     std::string body = msg->serialize();
     std::cout << body << std::endl;
     auto resp = MessageFactory::create<TopicResponse>();
-    resp->setId("12313");
+    resp->setId(12313);
     resp->setMessageType(MType::RSP_TOPIC);
     resp->setResponseCode(RCode::OK);
     conn->send(resp);
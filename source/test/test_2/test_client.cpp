@@ -31,7 +31,7 @@ int main()
     client->connect();
 
     auto req = MessageFactory::create<RpcRequest>();
-    req->setId("12312");
+    req->setId(12312);
     req->setMethod("Add");
     req->setMessageType(MType::REQ_RPC);
     Json::Value paramas;
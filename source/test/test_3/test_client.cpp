@@ -19,7 +19,7 @@ int main()
     zrcrpc::client::RpcClient client(false, "127.0.0.1", 8888);
 
     auto req = MessageFactory::create<RpcRequest>();
-    req->setId("12312");
+    req->setId(12312);
     req->setMethod("Add");
     req->setMessageType(MType::REQ_RPC);
     Json::Value paramas;
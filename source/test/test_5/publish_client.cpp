@@ -18,6 +18,13 @@ int  main()
         DLOG("第%d次发布消息",i);
         client->publish("hello","world"+std::to_string(i));
     }
+    //流水线发布：不用每条消息都等一个来回，在途的消息超过窗口的时候才会阻塞
+    client->setPublishWindow(1024);
+    for(int i=0;i<10000;i++)
+    {
+        client->publishAsync("hello","async"+std::to_string(i));
+    }
+    client->waitPublished();
     //关闭连接`
     client->shutdown();
     return 0;
@@ -0,0 +1,86 @@
+#include "../../common/message.hpp"
+#include <chrono>
+#include <vector>
+
+// 对比JSON和BINARY两种编码方式下消息主体的编解码耗时以及编码以后的大小
+using namespace zrcrpc;
+
+static const int Count = 100000;
+
+template <typename Func>
+double costNs(Func func)
+{
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < Count; i++)
+    {
+        func();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() * 1.0 / Count;
+}
+
+void bench(const std::string &name, const BaseMessage::Ptr &msg)
+{
+    for (CodecType codec : {CodecType::JSON, CodecType::BINARY})
+    {
+        std::string body;
+        double encode = costNs([&]()
+                               { body.clear();
+                                 msg->serialize(codec, body); });
+        bool ok = true;
+        double decode = costNs([&]()
+                               {
+                                   BaseMessage::Ptr out = MessageFactory::create(msg->messageType());
+                                   ok = out->deserialize(codec, body.c_str(), body.size()) && ok; });
+        printf("%-16s %-7s encode %8.1f ns  decode %8.1f ns  size %6zu bytes %s\n", name.c_str(),
+               codec == CodecType::JSON ? "JSON" : "BINARY", encode, decode, body.size(), ok ? "" : "(decode failed)");
+    }
+}
+
+int main()
+{
+    auto rpc_req = MessageFactory::create<RpcRequest>();
+    rpc_req->setMessageType(MType::REQ_RPC);
+    rpc_req->setMethod("Add");
+    Json::Value params;
+    params["num1"] = 90;
+    params["num2"] = -10;
+    params["ratio"] = 0.75;
+    params["name"] = std::string(32, 'x');
+    for (int i = 0; i < 8; i++)
+        params["tags"].append("tag" + std::to_string(i));
+    rpc_req->setParams(params);
+    bench("RpcRequest", rpc_req);
+
+    auto rpc_rsp = MessageFactory::create<RpcResponse>();
+    rpc_rsp->setMessageType(MType::RSP_RPC);
+    rpc_rsp->setResponseCode(RCode::OK);
+    rpc_rsp->setResult(params);
+    bench("RpcResponse", rpc_rsp);
+
+    auto topic_req = MessageFactory::create<TopicRequest>();
+    topic_req->setMessageType(MType::REQ_TOPIC);
+    topic_req->setKey("md.eq.AAPL");
+    topic_req->setOperationType(TopicOptype::TOPIC_PUBLISH);
+    topic_req->setMessage(std::string(256, 'm'));
+    bench("TopicRequest", topic_req);
+
+    auto svc_req = MessageFactory::create<ServiceRequest>();
+    svc_req->setMessageType(MType::REQ_SERVICE);
+    svc_req->setMethod("Add");
+    svc_req->setOperationType(ServiceOptype::SERVICE_REGISTRY);
+    svc_req->setHost(Address("127.0.0.1", 9090));
+    bench("ServiceRequest", svc_req);
+
+    auto svc_rsp = MessageFactory::create<ServiceResponse>();
+    svc_rsp->setMessageType(MType::RSP_SERVICE);
+    svc_rsp->setResponseCode(RCode::OK);
+    svc_rsp->setOperationType(ServiceOptype::SERVICE_DISCOVERY);
+    svc_rsp->setMethod("Add");
+    std::vector<Address> hosts;
+    for (int i = 0; i < 8; i++)
+        hosts.emplace_back("192.168.0." + std::to_string(i), 9000 + i);
+    svc_rsp->setHosts(hosts);
+    bench("ServiceResponse", svc_rsp);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "../../common/dispather.hpp"
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+// 测量Dispatcher分发一条消息的耗时，分别在1、8、32个线程同时分发的情况下测试
+// 作为对比，LockedDispatcher是原来的实现：加锁查哈希表，再用dynamic_pointer_cast转换消息类型
+using namespace zrcrpc;
+
+static const int Count = 1000000; // 每个线程分发的消息数量
+
+class NullConnection : public BaseConnection
+{
+public:
+    virtual void send(const BaseMessage::Ptr &message) override {}
+    virtual Frame frame(const BaseMessage::Ptr &message) const override { return Frame(); }
+    virtual void sendFrame(const Frame &frame) override {}
+    virtual void shutdown() override {}
+    virtual bool isConnected() const override { return true; }
+    virtual bool isClosed() const override { return false; }
+    virtual void runAfter(double delay, const std::function<void()> &task) override {}
+    virtual CodecType codec() const override { return CodecType::JSON; }
+    virtual void setCodec(CodecType codec) override {}
+};
+
+class LockedDispatcher
+{
+public:
+    template <typename T>
+    void registryCallBack(const MType &mtype, const std::function<void(const BaseConnection::Ptr &, const std::shared_ptr<T> &)> &handler)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _call_backs[mtype] = [handler](const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg)
+        { handler(conn, std::dynamic_pointer_cast<T>(msg)); };
+    }
+    void onMessage(const BaseConnection::Ptr &conn, const BaseMessage::Ptr &msg)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _call_backs.find(msg->messageType());
+        if (it != _call_backs.end())
+            it->second(conn, msg);
+    }
+
+private:
+    std::mutex _mutex;
+    std::unordered_map<MType, std::function<void(const BaseConnection::Ptr &, const BaseMessage::Ptr &)>> _call_backs;
+};
+
+// 打印每个线程分发一条消息的平均耗时，以及所有线程加起来的吞吐
+template <typename D>
+void bench(const char *name, D &dispatcher, int thread_num)
+{
+    BaseConnection::Ptr conn = std::make_shared<NullConnection>();
+    std::vector<BaseMessage::Ptr> msgs;
+    for (int i = 0; i < thread_num; i++)
+    {
+        auto req = MessageFactory::create<RpcRequest>();
+        req->setMessageType(MType::REQ_RPC);
+        msgs.push_back(req);
+    }
+    std::vector<std::thread> threads;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < thread_num; i++)
+    {
+        threads.emplace_back([&, i]()
+                             {
+                                 for (int j = 0; j < Count; j++)
+                                     dispatcher.onMessage(conn, msgs[i]); });
+    }
+    for (auto &th : threads)
+        th.join();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+    printf("%-18s threads %2d  %8.1f ns/msg per thread  %8.2f Mmsg/s total\n", name, thread_num,
+           ns / Count, thread_num * (double)Count / ns * 1000);
+}
+
+int main()
+{
+    std::atomic<size_t> handled(0);
+    auto handler = [&handled](const BaseConnection::Ptr &, const RpcRequest::Ptr &req)
+    { handled.fetch_add(req ? 1 : 0, std::memory_order_relaxed); };
+
+    Dispatcher dispatcher;
+    dispatcher.registryCallBack<RpcRequest>(MType::REQ_RPC, handler);
+    LockedDispatcher locked;
+    locked.registryCallBack<RpcRequest>(MType::REQ_RPC, handler);
+
+    for (int thread_num : {1, 8, 32})
+    {
+        bench("Dispatcher", dispatcher, thread_num);
+        bench("LockedDispatcher", locked, thread_num);
+    }
+    printf("handled %zu messages\n", handled.load());
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "../../client/requestor.hpp"
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+// 64个线程同时通过同一个Reuqestor发送同步请求，测量请求表在竞争下的吞吐
+// 连接在send里面直接构造响应交给onResponse，所以测到的是请求表的插入、查找删除以及promise的开销，不包括网络
+// 作为对比，LockedTable是原来的实现：一把锁保护整张表，收到响应的时候先查找再删除，加两次锁
+using namespace zrcrpc;
+using namespace zrcrpc::client;
+
+static const int ThreadNum = 64;
+static const int Count = 20000; // 每个线程发送的请求数量
+
+class LoopbackConnection : public BaseConnection
+{
+public:
+    LoopbackConnection(Reuqestor *requestor) : _requestor(requestor) {}
+    virtual void send(const BaseMessage::Ptr &message) override
+    {
+        auto rsp = MessageFactory::create<RpcResponse>();
+        rsp->setId(message->id());
+        rsp->setMessageType(MType::RSP_RPC);
+        rsp->setResponseCode(RCode::OK);
+        _requestor->onResponse(BaseConnection::Ptr(), rsp);
+    }
+    virtual Frame frame(const BaseMessage::Ptr &message) const override { return Frame(); }
+    virtual void sendFrame(const Frame &frame) override {}
+    virtual void shutdown() override {}
+    virtual bool isConnected() const override { return true; }
+    virtual bool isClosed() const override { return false; }
+    virtual void runAfter(double delay, const std::function<void()> &task) override {}
+    virtual CodecType codec() const override { return CodecType::JSON; }
+    virtual void setCodec(CodecType codec) override {}
+
+private:
+    Reuqestor *_requestor;
+};
+
+class LockedTable
+{
+public:
+    using Describe = Reuqestor::RequestDescribe;
+    Describe::Ptr create(const BaseMessage::Ptr &req)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto rd = std::make_shared<Describe>();
+        rd->_request = req;
+        rd->_rtype = RpcType::REQ_ASYNC;
+        _table[req->id()] = rd;
+        return rd;
+    }
+    void onResponse(const BaseMessage::Ptr &msg)
+    {
+        Describe::Ptr rd;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _table.find(msg->id());
+            if (it == _table.end())
+                return;
+            rd = it->second;
+        }
+        rd->_response.set_value(msg);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _table.erase(msg->id());
+    }
+
+private:
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, Describe::Ptr> _table;
+};
+
+template <typename Func>
+void bench(const char *name, Func func)
+{
+    std::vector<std::thread> threads;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < ThreadNum; i++)
+    {
+        threads.emplace_back([&]()
+                             {
+                                 for (int j = 0; j < Count; j++)
+                                     func(); });
+    }
+    for (auto &th : threads)
+        th.join();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+    printf("%-12s callers %d  %8.2f Mcalls/s  %8.1f ns/call\n", name, ThreadNum,
+           ThreadNum * (double)Count / ns * 1000, ns / (ThreadNum * (double)Count));
+}
+
+int main()
+{
+    auto requestor = std::make_shared<Reuqestor>();
+    BaseConnection::Ptr conn = std::make_shared<LoopbackConnection>(requestor.get());
+    std::atomic<size_t> failed(0);
+    bench("Reuqestor", [&]()
+          {
+              auto req = MessageFactory::create<RpcRequest>();
+              req->setId(UUID::uuid());
+              req->setMessageType(MType::REQ_RPC);
+              BaseMessage::Ptr rsp;
+              if (!requestor->send(conn, req, rsp) || !rsp)
+                  failed++; });
+
+    LockedTable table;
+    bench("LockedTable", [&]()
+          {
+              auto req = MessageFactory::create<RpcRequest>();
+              req->setId(UUID::uuid());
+              req->setMessageType(MType::REQ_RPC);
+              auto future = table.create(req)->_response.get_future();
+              auto rsp = MessageFactory::create<RpcResponse>();
+              rsp->setId(req->id());
+              rsp->setMessageType(MType::RSP_RPC);
+              rsp->setResponseCode(RCode::OK);
+              table.onResponse(rsp);
+              if (!future.get())
+                  failed++; });
+    printf("failed %zu\n", failed.load());
+    return 0;
+}